@@ -0,0 +1,544 @@
+/*Load generator for httpc: keeps a number of connections busy with a mix of
+  requests for a while, and prints how many requests were answered a second
+  and how long they took, so changes to the server can be compared by numbers.*/
+/*Like microbench, the result is printed as one line of space separated
+  key=value pairs, latencies are in microseconds.*/
+#include "httpc.h"
+#include <sys/resource.h>
+
+/*Kinds of request in the mix*/
+enum {
+	REQ_SMALL,
+	REQ_LARGE,
+	REQ_MISSING,
+	REQ_HEAD,
+	REQ_KINDS
+};
+
+/*Names used for the kinds by -m*/
+const char *req_names[REQ_KINDS] = {"small", "large", "404", "head"};
+/*Paths requested by each kind, the small file is also used by HEAD*/
+const char *req_paths[REQ_KINDS] = {"/index.html", "/large.bin", "/httpc-bench-missing", NULL};
+/*Share of the requests each kind gets, out of their sum*/
+unsigned int req_weights[REQ_KINDS] = {100, 0, 0, 0};
+
+/*Rendered requests, one per kind*/
+char *req_text[REQ_KINDS];
+size_t req_len[REQ_KINDS];
+/*Length of the longest one, which sizes the write buffers*/
+size_t req_maxlen;
+
+/*Settings*/
+const char *bench_address = "127.0.0.1";
+const char *bench_port    = "8081";
+unsigned int bench_conns   = 100;
+unsigned int bench_threads = 1;
+unsigned int bench_seconds = 10;
+/*Requests written to a connection at once, before reading any answers*/
+unsigned int bench_depth   = 1;
+bool bench_keepalive       = true;
+
+#define BENCH_MAX_DEPTH 64
+/*Largest response header that is accepted*/
+#define BENCH_HEADER_MAX 2048
+/*Response bodies are read into this and thrown away*/
+#define BENCH_READ_LEN (256*1024)
+
+/*Monotonic time the benchmark ends at*/
+uint64_t bench_end;
+
+typedef struct {
+	int fd;
+
+	/*Requests written and not answered yet, oldest first at head*/
+	uint64_t sent[BENCH_MAX_DEPTH];
+	unsigned char kinds[BENCH_MAX_DEPTH];
+	unsigned int head;
+	unsigned int outstanding;
+
+	/*Requests waiting to be written*/
+	char *out;
+	size_t outlen;
+	size_t outoff;
+
+	/*Header of the response being read*/
+	char in[BENCH_HEADER_MAX];
+	size_t inlen;
+	/*Body bytes of the response still to come, once the header is read*/
+	size_t body;
+	bool inbody;
+	unsigned int status;
+}conn_t;
+
+typedef struct {
+	pthread_t thread;
+	unsigned int nconns;
+	conn_t *conns;
+	hist_t hist;
+	uint64_t rng;
+
+	/*Counters, added up by main*/
+	uint64_t requests;
+	uint64_t errors;
+	uint64_t connects;
+	uint64_t bytes;
+	/*Responses by the first digit of their status*/
+	uint64_t status[6];
+}bench_thread_t;
+
+/*Returns the time in nanoseconds*/
+uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/*xorshift64, good enough to pick request kinds*/
+uint64_t bench_rand(bench_thread_t *thr)
+{
+	thr->rng ^= thr->rng << 13;
+	thr->rng ^= thr->rng >> 7;
+	thr->rng ^= thr->rng << 17;
+	return thr->rng;
+}
+
+/*Picks the kind of the next request by the weights of the mix*/
+unsigned char bench_pick(bench_thread_t *thr)
+{
+	unsigned int i, sum, pick;
+
+	for (i = 0, sum = 0; i < REQ_KINDS; i++)
+		sum += req_weights[i];
+
+	pick = (unsigned int)(bench_rand(thr) % sum);
+	for (i = 0; pick >= req_weights[i]; i++)
+		pick -= req_weights[i];
+
+	return (unsigned char)i;
+}
+
+/*Renders the request for every kind, once*/
+void bench_render(void)
+{
+	unsigned int i;
+	int len;
+
+	req_paths[REQ_HEAD] = req_paths[REQ_SMALL];
+
+	for (i = 0; i < REQ_KINDS; i++) {
+		len = asprintf(&req_text[i], "%s %s HTTP/1.1\r\nHost: %s\r\n"
+			       "User-Agent: httpc-bench\r\n%s\r\n",
+			       (i == REQ_HEAD) ? "HEAD" : "GET", req_paths[i], bench_address,
+			       bench_keepalive ? "" : "Connection: close\r\n");
+		if (len < 0)
+			die("Failed to allocate memory.\n");
+		req_len[i] = (size_t)len;
+		if (req_len[i] > req_maxlen)
+			req_maxlen = req_len[i];
+	}
+}
+
+/*Queues a batch of bench_depth requests, timed from now*/
+void conn_queue(bench_thread_t *thr, conn_t *conn, uint64_t now)
+{
+	unsigned int i;
+	unsigned char kind;
+
+	conn->outlen = conn->outoff = 0;
+	for (i = 0; i < bench_depth; i++) {
+		kind = bench_pick(thr);
+		memcpy(conn->out + conn->outlen, req_text[kind], req_len[kind]);
+		conn->outlen += req_len[kind];
+
+		conn->kinds[(conn->head + conn->outstanding) % BENCH_MAX_DEPTH] = kind;
+		conn->sent [(conn->head + conn->outstanding) % BENCH_MAX_DEPTH] = now;
+		conn->outstanding++;
+	}
+}
+
+/*Writes as much of the queued requests as the socket takes,
+  returns false when the connection failed*/
+bool conn_flush(conn_t *conn)
+{
+	ssize_t ret;
+
+	while (conn->outoff < conn->outlen) {
+		ret = send(conn->fd, conn->out + conn->outoff,
+			   conn->outlen - conn->outoff, MSG_NOSIGNAL);
+		if (ret < 0)
+			return (errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == ENOTCONN);
+		conn->outoff += (size_t)ret;
+	}
+
+	return true;
+}
+
+/*Connects, and queues the first batch of requests. The nonblocking connect
+  finishes in the background and the requests go out when epoll says so.*/
+void conn_open(bench_thread_t *thr, conn_t *conn, int efd, uint64_t now)
+{
+	struct epoll_event event;
+
+	conn->head = conn->outstanding = 0;
+	conn->inlen  = 0;
+	conn->inbody = false;
+
+	/*Failing to connect at all is fatal, the server isn't there*/
+	conn->fd = create_sock(bench_address, bench_port, true);
+	if (conn->fd < 0)
+		die("Failed to connect to %s:%s\n", bench_address, bench_port);
+	thr->connects++;
+
+	event.data.ptr = conn;
+	event.events   = EPOLLIN | EPOLLOUT | EPOLLET | EPOLLRDHUP;
+	if (epoll_ctl(efd, EPOLL_CTL_ADD, conn->fd, &event) < 0)
+		die("Failed to add connection to epoll.\n");
+
+	conn_queue(thr, conn, now);
+}
+
+void conn_reopen(bench_thread_t *thr, conn_t *conn, int efd, uint64_t now)
+{
+	/*Closing removes it from epoll*/
+	close(conn->fd);
+	conn_open(thr, conn, efd, now);
+}
+
+/*Reads the status and body length out of a complete response header,
+  returns false if it isn't a http response*/
+bool conn_header(conn_t *conn, unsigned char kind)
+{
+	char *line, *end;
+	size_t length;
+
+	conn->in[conn->inlen] = '\0';
+	if (strncmp(conn->in, "HTTP/1.", 7) || (conn->inlen < 12))
+		return false;
+
+	conn->status = (unsigned int)strtoul(conn->in + 9, &end, 10);
+	if ((end == conn->in + 9) || (conn->status < 100) || (conn->status > 599))
+		return false;
+
+	/*Every httpc response has a length, it's the only framing used*/
+	length = 0;
+	for (line = strstr(conn->in, "\r\n"); line; line = strstr(line + 2, "\r\n")) {
+		if (!strncasecmp(line + 2, "Content-Length:", 15)) {
+			length = strtoul(line + 17, NULL, 10);
+			break;
+		}
+	}
+
+	/*No body comes with these, whatever the length says*/
+	if ((kind == REQ_HEAD) || (conn->status == 304) || (conn->status == 204) ||
+	    (conn->status < 200))
+		length = 0;
+
+	conn->body = length;
+	return true;
+}
+
+/*A response has been read completely: records it, and starts the next
+  requests. Returns false when the connection has to be opened again.*/
+bool conn_done(bench_thread_t *thr, conn_t *conn, uint64_t now)
+{
+	hist_record(&thr->hist, now - conn->sent[conn->head]);
+	thr->requests++;
+	thr->status[conn->status / 100]++;
+
+	conn->head = (conn->head + 1) % BENCH_MAX_DEPTH;
+	conn->outstanding--;
+	conn->inlen  = 0;
+	conn->inbody = false;
+
+	if (!bench_keepalive)
+		return false;
+
+	if (!conn->outstanding)
+		conn_queue(thr, conn, now);
+
+	return true;
+}
+
+/*Goes through received bytes, which may hold the ends and starts of several
+  responses. Returns false when the connection has to be opened again.*/
+bool conn_input(bench_thread_t *thr, conn_t *conn, const char *buf, size_t len, uint64_t now)
+{
+	size_t n;
+	char *end;
+
+	while (len) {
+		if (!conn->outstanding)
+			goto fail;
+
+		if (conn->inbody) {
+			n = (len < conn->body) ? len : conn->body;
+			conn->body -= n;
+			buf += n;
+			len -= n;
+		} else {
+			/*Header bytes are collected until the empty line*/
+			n = BENCH_HEADER_MAX - 1 - conn->inlen;
+			if (!n)
+				goto fail;
+			n = (len < n) ? len : n;
+			memcpy(conn->in + conn->inlen, buf, n);
+			conn->in[conn->inlen + n] = '\0';
+
+			end = strstr(conn->in + ((conn->inlen > 3) ? (conn->inlen - 3) : 0), "\r\n\r\n");
+			if (!end) {
+				conn->inlen += n;
+				buf += n;
+				len -= n;
+				continue;
+			}
+
+			/*Only the bytes up to the end of the header are part of it*/
+			n = (size_t)(end + 4 - conn->in) - conn->inlen;
+			conn->inlen += n;
+			buf += n;
+			len -= n;
+
+			if (!conn_header(conn, conn->kinds[conn->head]))
+				goto fail;
+			conn->inbody = true;
+		}
+
+		/*Bodies of length 0 end right after their header*/
+		if (conn->inbody && !conn->body && !conn_done(thr, conn, now))
+			return false;
+	}
+
+	return true;
+
+fail:
+	thr->errors++;
+	return false;
+}
+
+void *bench_main(void *arg)
+{
+	int efd, nfds, i;
+	bool alive;
+	ssize_t ret;
+	uint64_t now;
+	unsigned int c;
+	char *buf;
+	conn_t *conn;
+	bench_thread_t *thr;
+	struct epoll_event *events;
+
+	thr    = arg;
+	buf    = palloc(sizeof(char), BENCH_READ_LEN);
+	events = palloc(sizeof(struct epoll_event), thr->nconns);
+
+	efd = epoll_create1(0);
+	if (efd < 0)
+		die("Failed to create epoll file descriptor.\n");
+
+	now = now_ns();
+	for (c = 0; c < thr->nconns; c++) {
+		thr->conns[c].out = palloc(sizeof(char), bench_depth * req_maxlen);
+		conn_open(thr, &thr->conns[c], efd, now);
+	}
+
+	while ((now = now_ns()) < bench_end) {
+		/*Wakes up now and then to notice the end*/
+		nfds = epoll_wait(efd, events, (int)thr->nconns, 100);
+		if (nfds < 0) {
+			if (errno == EINTR)
+				continue;
+			die("epoll_wait failed\n");
+		}
+
+		for (i = 0; i < nfds; i++) {
+			conn  = events[i].data.ptr;
+			alive = true;
+
+			if (events[i].events & EPOLLIN) {
+				while ((ret = recv(conn->fd, buf, BENCH_READ_LEN, 0)) > 0) {
+					thr->bytes += (uint64_t)ret;
+					alive = conn_input(thr, conn, buf, (size_t)ret, now_ns());
+					if (!alive)
+						break;
+				}
+
+				/*The server closing in the middle of a response is an error,
+				  it closing a short connection after it is not*/
+				if (alive && ((ret == 0) || ((ret < 0) && (errno != EAGAIN)))) {
+					thr->errors++;
+					alive = false;
+				}
+			} else if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+				thr->errors++;
+				alive = false;
+			}
+
+			if (alive && !conn_flush(conn)) {
+				thr->errors++;
+				alive = false;
+			}
+
+			if (!alive)
+				conn_reopen(thr, conn, efd, now_ns());
+		}
+	}
+
+	for (c = 0; c < thr->nconns; c++) {
+		close(thr->conns[c].fd);
+		free(thr->conns[c].out);
+	}
+	close(efd);
+	free(events);
+	free(buf);
+
+	return NULL;
+}
+
+/*Parses a mix like small=80,404=10,head=10 into req_weights*/
+void bench_mix(char *mix)
+{
+	char *item, *save, *eq;
+	unsigned int i, sum;
+
+	memset(req_weights, 0, sizeof(req_weights));
+
+	for (item = strtok_r(mix, ",", &save); item; item = strtok_r(NULL, ",", &save)) {
+		eq = strchr(item, '=');
+		if (!eq)
+			die("Mix entries look like kind=weight\n");
+		*eq = '\0';
+
+		for (i = 0; (i < REQ_KINDS) && strcmp(item, req_names[i]); i++);
+		if (i == REQ_KINDS)
+			die("Request kinds are small, large, 404 and head\n");
+
+		req_weights[i] = (unsigned int)strtoul(eq + 1, NULL, 10);
+	}
+
+	for (i = 0, sum = 0; i < REQ_KINDS; i++)
+		sum += req_weights[i];
+	if (!sum)
+		die("The mix needs a weight above 0\n");
+}
+
+int main(int argc, char *argv[])
+{
+	int opt;
+	unsigned int i, j;
+	uint64_t start;
+	double seconds;
+	struct rlimit lim;
+	bench_thread_t *threads, total;
+
+	while ((opt = getopt(argc, argv, "a:p:c:t:d:P:Cm:s:l:")) != -1) {
+		switch (opt) {
+		case 'a':
+			bench_address = optarg;
+			break;
+		case 'p':
+			bench_port = optarg;
+			break;
+		case 'c':
+			bench_conns = (unsigned int)strtoul(optarg, NULL, 10);
+			break;
+		case 't':
+			bench_threads = (unsigned int)strtoul(optarg, NULL, 10);
+			break;
+		case 'd':
+			bench_seconds = (unsigned int)strtoul(optarg, NULL, 10);
+			break;
+		case 'P':
+			bench_depth = (unsigned int)strtoul(optarg, NULL, 10);
+			if (!bench_depth || (bench_depth > BENCH_MAX_DEPTH))
+				die("Pipeline depth must be 1 to %d\n", BENCH_MAX_DEPTH);
+			break;
+		case 'C':
+			bench_keepalive = false;
+			break;
+		case 'm':
+			bench_mix(optarg);
+			break;
+		case 's':
+			req_paths[REQ_SMALL] = optarg;
+			break;
+		case 'l':
+			req_paths[REQ_LARGE] = optarg;
+			break;
+		default:
+			die("usage: %s [-a address] [-p port] [-c connections] [-t threads] "
+			    "[-d seconds] [-P pipeline depth] [-C close connections] "
+			    "[-m mix, like small=80,large=5,404=10,head=5] "
+			    "[-s small file path] [-l large file path]\n", argv[0]);
+		}
+	}
+
+	if (!bench_threads || !bench_conns || !bench_seconds)
+		die("Threads, connections and seconds must be at least 1\n");
+	if (bench_threads > bench_conns)
+		bench_threads = bench_conns;
+	/*A short connection only has the one request*/
+	if (!bench_keepalive)
+		bench_depth = 1;
+
+	/*Thousands of connections need more than the usual 1024 descriptors*/
+	if (!getrlimit(RLIMIT_NOFILE, &lim) && (lim.rlim_cur < lim.rlim_max)) {
+		lim.rlim_cur = lim.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &lim);
+	}
+
+	bench_render();
+
+	threads = palloc(sizeof(bench_thread_t), bench_threads);
+	start     = now_ns();
+	bench_end = start + (uint64_t)bench_seconds * 1000000000ull;
+	for (i = 0; i < bench_threads; i++) {
+		/*Connections are spread evenly, the first threads take the rest*/
+		threads[i].nconns = bench_conns / bench_threads + (i < (bench_conns % bench_threads));
+		threads[i].conns  = palloc(sizeof(conn_t), threads[i].nconns);
+		threads[i].rng    = 0x9e3779b97f4a7c15ull * (i + 1);
+		hist_init(&threads[i].hist);
+
+		if (pthread_create(&threads[i].thread, NULL, bench_main, &threads[i]))
+			die("Failed to start thread %u\n", i);
+	}
+
+	memset(&total, 0, sizeof(total));
+	hist_init(&total.hist);
+	for (i = 0; i < bench_threads; i++) {
+		pthread_join(threads[i].thread, NULL);
+
+		hist_merge(&total.hist, &threads[i].hist);
+		total.requests += threads[i].requests;
+		total.errors   += threads[i].errors;
+		total.connects += threads[i].connects;
+		total.bytes    += threads[i].bytes;
+		for (j = 0; j < 6; j++)
+			total.status[j] += threads[i].status[j];
+
+		free(threads[i].conns);
+	}
+	seconds = (double)(now_ns() - start) / 1e9;
+
+	printf("connections=%u threads=%u depth=%u keepalive=%d seconds=%.2f "
+	       "requests=%llu errors=%llu connects=%llu rps=%.1f mb_per_s=%.2f "
+	       "status_2xx=%llu status_3xx=%llu status_4xx=%llu status_5xx=%llu "
+	       "p50_us=%.1f p90_us=%.1f p99_us=%.1f p999_us=%.1f max_us=%.1f\n",
+	       bench_conns, bench_threads, bench_depth, bench_keepalive, seconds,
+	       (unsigned long long)total.requests, (unsigned long long)total.errors,
+	       (unsigned long long)total.connects, total.requests / seconds,
+	       total.bytes / seconds / 1e6,
+	       (unsigned long long)total.status[2], (unsigned long long)total.status[3],
+	       (unsigned long long)total.status[4], (unsigned long long)total.status[5],
+	       hist_percentile(&total.hist, 50.0)  / 1e3,
+	       hist_percentile(&total.hist, 90.0)  / 1e3,
+	       hist_percentile(&total.hist, 99.0)  / 1e3,
+	       hist_percentile(&total.hist, 99.9)  / 1e3,
+	       total.hist.max / 1e3);
+
+	for (i = 0; i < REQ_KINDS; i++)
+		free(req_text[i]);
+	free(threads);
+	return 0;
+}
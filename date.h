@@ -0,0 +1,133 @@
+/*Http dates: formatting them without gmtime_r, a cached one for the current
+  second, and parsing the ones clients send*/
+
+/*_XOPEN_SOURCE is required for strptime, _GNU_SOURCE already implies it*/
+#ifndef _XOPEN_SOURCE
+#define _XOPEN_SOURCE
+#endif
+#include <time.h>
+
+/*0 Jan, 1 Feb, 2 Mar, 3 Apr, 4 May, 5 Jun,
+  6 Jul, 7 Aug, 8 Sep, 9 Oct, 10 Nov, 11 Dec*/
+char *month[] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun",
+		 "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+/*0 Sun, 1 Mon, 2 Tue, 3 Wed, 4 Thu, 5 Fri, 6 Sat*/
+char *wkday[] = {"Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"};
+/*Same as above, just the expanded version*/
+char *weekday[] = {"Sunday", "Monday", "Tuesday", "Wednesday", "Thursday", "Friday", "Saturday"};
+
+/*rfc1123-date example from spec = Sun, 06 Nov 1994 08:49:37 GMT*/
+/*Length of an rfc1123-date, the only format ever written*/
+#define HTTP_DATE_LEN 29
+
+/*"Date: " and the current second followed by CRLF, rewritten by date_tick*/
+__thread char date_line[6 + HTTP_DATE_LEN + 2];
+/*The second date_line was written for, which doubles as the clock of the
+  whole worker, so a pass of the event loop only reads the time once*/
+__thread time_t date_now = -1;
+
+/*Writes two digits*/
+void date_digits(char *buf, unsigned int num)
+{
+	buf[0] = (char)('0' + (num / 10) % 10);
+	buf[1] = (char)('0' + num % 10);
+}
+
+/*Writes sec in rfc1123-date format to buf, which needs HTTP_DATE_LEN bytes.
+  Done by hand rather than with gmtime_r, days are turned into a date
+  with Howard Hinnant's days_from_civil algorithm run backwards.*/
+void http_date(char *buf, time_t sec)
+{
+	long long days, secs, era, doe, yoe, doy, mp, year, mon, mday;
+
+	days = sec / 86400;
+	secs = sec % 86400;
+	if (secs < 0) {
+		secs += 86400;
+		days--;
+	}
+
+	/*Day 0 of the epoch was a Thursday*/
+	memcpy(buf, wkday[((days % 7) + 11) % 7], 3);
+
+	/*Eras are 400 year cycles, starting on the 1st of March*/
+	days += 719468;
+	era   = ((days >= 0) ? days : (days - 146096)) / 146097;
+	doe   = days - era * 146097;
+	yoe   = (doe - doe/1460 + doe/36524 - doe/146096) / 365;
+	doy   = doe - (365*yoe + yoe/4 - yoe/100);
+	mp    = (5*doy + 2) / 153;
+	mday  = doy - (153*mp + 2)/5 + 1;
+	mon   = (mp < 10) ? (mp + 3) : (mp - 9);
+	year  = yoe + era*400 + (mon <= 2);
+
+	/*Sun, 06 Nov 1994 08:49:37 GMT*/
+	memcpy(buf + 3, ", ", 2);
+	date_digits(buf + 5, mday);
+	buf[7] = ' ';
+	memcpy(buf + 8, month[mon - 1], 3);
+	buf[11] = ' ';
+	/*Only supports years 0 to 9999*/
+	date_digits(buf + 12, year / 100);
+	date_digits(buf + 14, year % 100);
+	buf[16] = ' ';
+	date_digits(buf + 17, secs / 3600);
+	buf[19] = ':';
+	date_digits(buf + 20, (secs / 60) % 60);
+	buf[22] = ':';
+	date_digits(buf + 23, secs % 60);
+	memcpy(buf + 25, " GMT", 4);
+}
+
+/*Writes date in rfc1123-date format, the preferred format in the http/1.1 specification*/
+void dateappend(client_data_t *cdata, time_t sec)
+{
+	char buf[HTTP_DATE_LEN];
+
+	http_date(buf, sec);
+	bufappend(cdata, buf, HTTP_DATE_LEN);
+}
+
+/*Called once every pass of the event loop, the date is only formatted
+  again when the second has changed*/
+void date_tick(void)
+{
+	time_t now;
+
+	now = time(NULL);
+	if (now == date_now)
+		return;
+
+	date_now = now;
+	memcpy(date_line, "Date: ", 6);
+	http_date(date_line + 6, now);
+	memcpy(date_line + 6 + HTTP_DATE_LEN, "\r\n", 2);
+}
+
+/*The three date formats http/1.1 requires recipients to accept*/
+const char *http_date_fmt[] = {
+	/*rfc1123-date: Sun, 06 Nov 1994 08:49:37 GMT*/
+	"%a, %d %b %Y %H:%M:%S GMT",
+	/*rfc850-date:  Sunday, 06-Nov-94 08:49:37 GMT*/
+	"%A, %d-%b-%y %H:%M:%S GMT",
+	/*asctime-date: Sun Nov  6 08:49:37 1994*/
+	"%a %b %d %H:%M:%S %Y"
+};
+
+/*Returns the epoch of a http date, -1 if it isn't in any of the valid formats*/
+time_t parse_http_date(const char *str)
+{
+	size_t i;
+	char *end;
+	struct tm caltime;
+
+	for (i = 0; i < sizeof(http_date_fmt)/sizeof(http_date_fmt[0]); i++) {
+		memset(&caltime, 0, sizeof(caltime));
+
+		end = strptime(str, http_date_fmt[i], &caltime);
+		if (end && !*end)
+			return timegm(&caltime);
+	}
+
+	return -1;
+}
@@ -0,0 +1,478 @@
+/*Open file cache: keeps the fd and stat information of recently requested
+  files around, so hot files cost neither a stat nor an open per request.*/
+/*Every worker has its own cache, shared by all of that worker's connections.
+  Entries are refcounted by the connections sending them, and entries that get
+  evicted or go stale while still in use are freed on their last release.*/
+
+/*Maximum amount of cached files per worker, fcache_init lowers it to what
+  RLIMIT_NOFILE leaves room for*/
+const unsigned int fcache_max     = 1024;
+/*Amount of hash buckets, must be a power of two*/
+const unsigned int fcache_buckets = 2048;
+
+/*Precompressed siblings of a file, in order of preference*/
+enum {
+	FCACHE_BR,
+	FCACHE_GZ,
+	FCACHE_ENCODINGS
+};
+/*Content-Encoding names and file name suffixes of the siblings*/
+const char *fcache_encoding[] = {"br", "gzip"};
+const char *fcache_suffix[]   = {".br", ".gz"};
+
+/*Files up to this size keep their body in memory, set with -s, 0 disables it*/
+size_t fcache_body_max    = 16384;
+/*Memory for cached bodies of all workers together, set with -m*/
+size_t fcache_body_budget = 64 << 20;
+
+struct _fcache_entry_t {
+	/*Null terminated copy of the request path*/
+	char *path;
+	size_t pathlen;
+	uint32_t hash;
+
+	/*Opened read-only, offsets are kept by the connections through sendfile*/
+	int fd;
+	struct stat st;
+	/*Last second the entry was checked against the file system*/
+	time_t checked;
+
+	/*Strong entity tag, built from the inode, size and modification time*/
+	char etag[64];
+	size_t etaglen;
+
+	/*Pre-rendered static part of the response header, NULL until the first hit.
+	  The header fields start at statuslen, right after the status line,
+	  and the Content-Length line starts at lengthpos.*/
+	char *header;
+	size_t headerlen;
+	size_t statuslen;
+	size_t lengthpos;
+
+	/*Whole file, for files small enough to be sent from memory,
+	  NULL if the file is too large or the budget is used up*/
+	char *body;
+
+	/*Open precompressed siblings that are smaller than the file, NULL where
+	  there is none. They aren't in the table, and go away with the entry.*/
+	fcache_entry_t *variants[FCACHE_ENCODINGS];
+	/*Index into fcache_encoding for entries of siblings, -1 for the file itself*/
+	int encoding;
+
+	/*Amount of connections using the entry*/
+	unsigned int refs;
+	/*Set when the entry is no longer reachable from the table*/
+	bool stale;
+
+	fcache_entry_t *hnext;
+	/*Most recently used entries are at the head*/
+	fcache_entry_t *lru_prev, *lru_next;
+};
+
+/*Tracking variables, one set per worker thread*/
+__thread fcache_entry_t **fcache_table;
+__thread fcache_entry_t *fcache_lru_head, *fcache_lru_tail;
+__thread size_t fcache_count;
+/*This worker's cap on fcache_count*/
+__thread size_t fcache_limit;
+/*Memory used by cached bodies, and this worker's share of fcache_body_budget*/
+__thread size_t fcache_body_bytes, fcache_body_limit;
+
+void fcache_init(void)
+{
+	size_t n;
+	struct rlimit rl;
+
+	fcache_table      = palloc(sizeof(fcache_entry_t*), fcache_buckets);
+	fcache_lru_head   = NULL;
+	fcache_lru_tail   = NULL;
+	fcache_count      = 0;
+	fcache_body_bytes = 0;
+	fcache_body_limit = fcache_body_budget / nworkers;
+
+	/*Half of the descriptors are left to connections and the other half is
+	  split between the workers, an entry may hold one for each sibling too*/
+	fcache_limit = fcache_max;
+	if (!getrlimit(RLIMIT_NOFILE, &rl) && (rl.rlim_cur != RLIM_INFINITY)) {
+		n = rl.rlim_cur / 2 / nworkers / (1 + FCACHE_ENCODINGS);
+		if (n < fcache_limit)
+			fcache_limit = n ? n : 1;
+	}
+}
+
+/*FNV-1a, paths are short so there isn't a point in anything fancier*/
+uint32_t fcache_hash(const char *path, size_t len)
+{
+	size_t i;
+	uint32_t hash;
+
+	for (i = 0, hash = 2166136261u; i < len; i++) {
+		hash ^= (unsigned char)path[i];
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+void fcache_lru_unlink(fcache_entry_t *entry)
+{
+	if (entry->lru_prev)
+		entry->lru_prev->lru_next = entry->lru_next;
+	else
+		fcache_lru_head = entry->lru_next;
+
+	if (entry->lru_next)
+		entry->lru_next->lru_prev = entry->lru_prev;
+	else
+		fcache_lru_tail = entry->lru_prev;
+
+	entry->lru_prev = NULL;
+	entry->lru_next = NULL;
+}
+
+void fcache_lru_push(fcache_entry_t *entry)
+{
+	entry->lru_prev = NULL;
+	entry->lru_next = fcache_lru_head;
+
+	if (fcache_lru_head)
+		fcache_lru_head->lru_prev = entry;
+	else
+		fcache_lru_tail = entry;
+
+	fcache_lru_head = entry;
+}
+
+void fcache_free_body(fcache_entry_t *entry)
+{
+	fcache_body_bytes -= entry->st.st_size;
+	free(entry->body);
+	entry->body = NULL;
+}
+
+void fcache_free(fcache_entry_t *entry);
+
+/*Detaches a sibling from its file, it is freed now or on its last release*/
+void fcache_drop_variant(fcache_entry_t *entry, int encoding)
+{
+	fcache_entry_t *variant;
+
+	variant = entry->variants[encoding];
+	entry->variants[encoding] = NULL;
+
+	variant->stale = true;
+	if (!variant->refs)
+		fcache_free(variant);
+}
+
+void fcache_free(fcache_entry_t *entry)
+{
+	int i;
+
+	for (i = 0; i < FCACHE_ENCODINGS; i++) {
+		if (entry->variants[i])
+			fcache_drop_variant(entry, i);
+	}
+
+	if ((entry->fd >= 0) && close(entry->fd))
+		die("fcache_free: fd\n");
+	if (entry->body)
+		fcache_free_body(entry);
+	free(entry->header);
+	free(entry->path);
+	free(entry);
+}
+
+/*Takes the entry out of the table, it is freed now or on its last release*/
+void fcache_remove(fcache_entry_t *entry)
+{
+	fcache_entry_t **p;
+
+	for (p = &fcache_table[entry->hash & (fcache_buckets-1)]; *p != entry; p = &(*p)->hnext)
+		assert(*p);
+	*p = entry->hnext;
+
+	fcache_lru_unlink(entry);
+	fcache_count--;
+
+	entry->stale = true;
+	if (!entry->refs)
+		fcache_free(entry);
+}
+
+/*Closes the least recently used entry no connection is sending, for its
+  descriptor. Returns false if every entry is in use.*/
+bool fcache_evict_idle(void)
+{
+	fcache_entry_t *entry;
+
+	for (entry = fcache_lru_tail; entry && entry->refs; entry = entry->lru_prev);
+	if (!entry)
+		return false;
+
+	fcache_remove(entry);
+	return true;
+}
+
+/*Returns true if st describes the same file the entry has open*/
+bool fcache_same(fcache_entry_t *entry, struct stat *st)
+{
+	return (st->st_ino   == entry->st.st_ino)   &&
+	       (st->st_dev   == entry->st.st_dev)   &&
+	       (st->st_size  == entry->st.st_size)  &&
+	       (st->st_mtim.tv_sec  == entry->st.st_mtim.tv_sec) &&
+	       (st->st_mtim.tv_nsec == entry->st.st_mtim.tv_nsec);
+}
+
+/*Drops the bodies of the least recently used entries until size more bytes fit,
+  bodies that are being sent are skipped*/
+void fcache_trim_bodies(size_t size)
+{
+	fcache_entry_t *entry;
+
+	for (entry = fcache_lru_tail; entry && ((fcache_body_bytes + size) > fcache_body_limit);
+	     entry = entry->lru_prev) {
+		if (entry->body && !entry->refs)
+			fcache_free_body(entry);
+	}
+}
+
+/*Reads a small file into memory, so it can go out in one write with its header*/
+void fcache_load_body(fcache_entry_t *entry)
+{
+	char *body;
+	size_t size;
+	struct stat st;
+
+	size = entry->st.st_size;
+	if (entry->body || !size || (size > fcache_body_max) || (size > fcache_body_limit))
+		return;
+
+	fcache_trim_bodies(size);
+	if ((fcache_body_bytes + size) > fcache_body_limit)
+		return;
+
+	body = palloc(sizeof(char), size);
+	if ((pread(entry->fd, body, size, 0) != (ssize_t)size) ||
+	    (fstat(entry->fd, &st) < 0) || !fcache_same(entry, &st)) {
+		/*Changed while being read, it is sent from the file instead*/
+		free(body);
+		return;
+	}
+
+	entry->body        = body;
+	fcache_body_bytes += size;
+}
+
+/*Makes a new unreferenced entry that isn't in the table yet for the file
+  open as fd, which is -1 for made up files. name is kept by the entry.*/
+fcache_entry_t *fcache_new(char *name, size_t len, uint32_t hash, int fd,
+			   struct stat *st, time_t now)
+{
+	fcache_entry_t *entry;
+
+	entry           = palloc(sizeof(fcache_entry_t), 1);
+	entry->path     = name;
+	entry->pathlen  = len;
+	entry->hash     = hash;
+	entry->fd       = fd;
+	entry->st       = *st;
+	entry->checked  = now;
+	entry->encoding = -1;
+
+	entry->etaglen = snprintf(entry->etag, sizeof(entry->etag), "\"%llx-%llx-%llx\"",
+				  (unsigned long long)st->st_ino,
+				  (unsigned long long)st->st_size,
+				  (unsigned long long)st->st_mtim.tv_sec * 1000000000ull +
+				  (unsigned long long)st->st_mtim.tv_nsec);
+
+	return entry;
+}
+
+/*Opens path into a new unreferenced entry that isn't in the table yet.
+  Returns NULL with errno set if the file can't be served.*/
+fcache_entry_t *fcache_open(const char *path, size_t len, uint32_t hash, time_t now)
+{
+	int fd;
+	char *name;
+	struct stat st;
+
+	/*The path isn't null terminated when it comes straight out of the request*/
+	name = palloc(sizeof(char), len+1);
+	memcpy(name, path, len);
+
+	if ((fd = open(name, O_RDONLY | O_NONBLOCK | O_CLOEXEC)) < 0) {
+		free(name);
+		return NULL;
+	}
+
+	/*fstat makes sure the stat information matches the opened file*/
+	if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+		close(fd);
+		free(name);
+		errno = EACCES;
+		return NULL;
+	}
+
+	/*Bodies too large for memory are read front to back by sendfile or
+	  splice, which lets the kernel read further ahead than usual*/
+	if ((size_t)st.st_size > fcache_body_max)
+		posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	return fcache_new(name, len, hash, fd, &st, now);
+}
+
+/*Where entries come from, microbench swaps in one that makes files up*/
+fcache_entry_t *(*fcache_source)(const char *path, size_t len, uint32_t hash, time_t now) = fcache_open;
+
+/*Looks for path.br and path.gz next to the file, keeping the ones that are
+  smaller open. Only runs when the entry is created or revalidated, so
+  negotiating an encoding costs no system calls per request.*/
+void fcache_probe_variants(fcache_entry_t *entry, time_t now)
+{
+	int i;
+	bool changed;
+	char *path;
+	struct stat st;
+	fcache_entry_t *variant;
+
+	path    = palloc(sizeof(char), entry->pathlen + 4);
+	changed = false;
+	memcpy(path, entry->path, entry->pathlen);
+
+	for (i = 0; i < FCACHE_ENCODINGS; i++) {
+		strcpy(path + entry->pathlen, fcache_suffix[i]);
+
+		if ((variant = entry->variants[i])) {
+			if (!stat(path, &st) && fcache_same(variant, &st) &&
+			    (st.st_size < entry->st.st_size))
+				continue;
+
+			fcache_drop_variant(entry, i);
+			changed = true;
+		}
+
+		variant = fcache_source(path, entry->pathlen + strlen(fcache_suffix[i]), 0, now);
+		if (!variant)
+			continue;
+
+		if (variant->st.st_size >= entry->st.st_size) {
+			fcache_free(variant);
+			continue;
+		}
+
+		variant->encoding  = i;
+		entry->variants[i] = variant;
+		changed            = true;
+
+		fcache_load_body(variant);
+	}
+
+	/*The rendered header lists Vary, which depends on the siblings*/
+	if (changed && entry->header) {
+		free(entry->header);
+		entry->header = NULL;
+	}
+
+	free(path);
+}
+
+/*Returns true if the file behind the entry is still the same one*/
+bool fcache_revalidate(fcache_entry_t *entry, time_t now)
+{
+	struct stat st;
+
+	if (entry->checked == now)
+		return true;
+
+	if (stat(entry->path, &st) < 0)
+		return false;
+
+	if (!fcache_same(entry, &st))
+		return false;
+
+	entry->checked = now;
+	fcache_probe_variants(entry, now);
+	return true;
+}
+
+/*Returns a referenced entry for the len bytes at path, opening and caching
+  the file if needed. Returns NULL with errno set if the file can't be served.*/
+fcache_entry_t *fcache_get(const char *path, size_t len)
+{
+	time_t now;
+	uint32_t hash;
+	fcache_entry_t *entry;
+
+	/*The clock of the event loop, updated once per pass*/
+	now  = date_now;
+	hash = fcache_hash(path, len);
+
+	for (entry = fcache_table[hash & (fcache_buckets-1)]; entry; entry = entry->hnext) {
+		if ((entry->hash != hash) || (entry->pathlen != len) ||
+		    memcmp(entry->path, path, len))
+			continue;
+
+		/*Changed or deleted files are dropped and looked up again*/
+		if (!fcache_revalidate(entry, now)) {
+			fcache_remove(entry);
+			break;
+		}
+
+		fcache_lru_unlink(entry);
+		fcache_lru_push(entry);
+		entry->refs++;
+		/*Bodies dropped to make room come back once the file is hot again*/
+		fcache_load_body(entry);
+		return entry;
+	}
+
+	/*Out of descriptors, the cached files nobody is sending give theirs back*/
+	while (!(entry = fcache_source(path, len, hash, now))) {
+		if (((errno != EMFILE) && (errno != ENFILE)) || !fcache_evict_idle())
+			return NULL;
+	}
+
+	/*Makes room by evicting the least recently used entry*/
+	if (fcache_count >= fcache_limit)
+		fcache_remove(fcache_lru_tail);
+
+	entry->refs  = 1;
+	entry->hnext = fcache_table[hash & (fcache_buckets-1)];
+	fcache_table[hash & (fcache_buckets-1)] = entry;
+	fcache_lru_push(entry);
+	fcache_count++;
+
+	fcache_load_body(entry);
+	fcache_probe_variants(entry, now);
+	return entry;
+}
+
+/*Stores the rendered static part of the response header with the entry*/
+void fcache_set_header(fcache_entry_t *entry, const char *header, size_t len)
+{
+	assert(!entry->header);
+
+	entry->header    = palloc(sizeof(char), len);
+	entry->headerlen = len;
+	memcpy(entry->header, header, len);
+}
+
+/*Drops a reference taken by fcache_get*/
+void fcache_release(fcache_entry_t *entry)
+{
+	assert(entry->refs);
+	entry->refs--;
+
+	if (entry->stale && !entry->refs)
+		fcache_free(entry);
+}
+
+/*Frees every cached file, in use references must be released first*/
+void fcache_destroy(void)
+{
+	while (fcache_lru_head)
+		fcache_remove(fcache_lru_head);
+
+	free(fcache_table);
+}
@@ -0,0 +1,1019 @@
+/*Cleartext HTTP/2 (rfc 9113), started with prior knowledge or with an
+  Upgrade: h2c request. The connection keeps its client_data_t and its epoll
+  registration, cb_h2 takes over as its callback and its HTTP/2 state hangs
+  off cdata->h2. Every stream gets a client_data_t of its own from the pool,
+  which is answered by gen_response like an HTTP/1.1 request: hpack.h decodes
+  the request into its tokens, and encodes the header gen_response renders.
+  Bodies go out as DATA frames, a frame of every stream with a body in turn,
+  from memory or with sendfile from the cached fd behind a frame header.*/
+/*Request bodies and their trailers aren't read, like for HTTP/1.1, streams
+  are answered as soon as their header is in and reset once the response is
+  sent if the client isn't done sending. Server push and priorities aren't
+  used. Needs the epoll engine, the io_uring one answers the preface with a 501.*/
+
+/*Streams a connection may have open at once, advertised in our SETTINGS*/
+#define H2_MAX_STREAMS 100
+/*Largest frame payload, which isn't raised, inbuf holds a frame of it*/
+#define H2_FRAME_MAX   16384
+/*Frames queued for sending, the headers of several responses fit*/
+#define H2_OUTBUF      16384
+/*Room a response needs in outbuf: a frame header, the response header
+  from gen_response at most, and a RST_STREAM after it*/
+#define H2_RESPONSE_ROOM (9 + headerlen + 64)
+/*Room a control frame needs, with a GOAWAY after it*/
+#define H2_CONTROL_ROOM 64
+
+/*Frame types*/
+enum {
+	H2_DATA,
+	H2_HEADERS,
+	H2_PRIORITY,
+	H2_RST_STREAM,
+	H2_SETTINGS,
+	H2_PUSH_PROMISE,
+	H2_PING,
+	H2_GOAWAY,
+	H2_WINDOW_UPDATE,
+	H2_CONTINUATION
+};
+
+/*Frame flags, END_STREAM and ACK share a bit*/
+#define H2_END_STREAM  0x1
+#define H2_ACK         0x1
+#define H2_END_HEADERS 0x4
+#define H2_PADDED      0x8
+#define H2_PRIO        0x20
+
+/*Error codes of RST_STREAM and GOAWAY*/
+enum {
+	H2_NO_ERROR,
+	H2_PROTOCOL_ERROR,
+	H2_INTERNAL_ERROR,
+	H2_FLOW_CONTROL_ERROR,
+	H2_SETTINGS_TIMEOUT,
+	H2_STREAM_CLOSED,
+	H2_FRAME_SIZE_ERROR,
+	H2_REFUSED_STREAM,
+	H2_CANCEL,
+	H2_COMPRESSION_ERROR
+};
+
+/*Results of h2_input and h2_output*/
+enum {
+	/*Everything that could be done is done*/
+	H2_DONE,
+	/*h2_input: frames wait for room in outbuf*/
+	H2_BLOCKED,
+	/*h2_output: the socket would block*/
+	H2_WAIT,
+	/*h2_output: the send budget is used up*/
+	H2_YIELD,
+	/*The connection has to be closed*/
+	H2_FAIL
+};
+
+const char h2_preface[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+/*The part parse_request takes for a request without header fields*/
+const unsigned int h2_preface_request = 18;
+
+/*The first response to an Upgrade: h2c request, before our SETTINGS*/
+const char h2_switching[] = "HTTP/1.1 101 Switching Protocols\r\n"
+			    "Connection: Upgrade\r\nUpgrade: h2c\r\n\r\n";
+
+typedef struct {
+	client_data_t *cdata;
+	uint32_t id;
+	/*What the client lets us send on the stream*/
+	int64_t window;
+	/*The client is done sending on it, it isn't reset after the response*/
+	bool ended;
+}h2_stream_t;
+
+struct _h2_conn_t {
+	hpack_table_t table;
+
+	/*Open streams, in no particular order*/
+	h2_stream_t streams[H2_MAX_STREAMS];
+	unsigned int nstreams;
+	/*Where the next look for a DATA frame to send starts, so streams take turns*/
+	unsigned int turn;
+	/*Highest stream the client has opened*/
+	uint32_t last_id;
+
+	/*What the client lets us send on the connection, and on new streams*/
+	int64_t window;
+	int64_t initial_window;
+	/*Largest frame the client takes*/
+	size_t max_frame;
+
+	/*Bytes of the client preface that have been received*/
+	unsigned int preface;
+	/*Payload of a DATA frame that is still to be received and dropped*/
+	size_t skip;
+	/*A header block spread over CONTINUATION frames, while it comes in*/
+	unsigned char *hblock;
+	size_t hblocklen;
+	uint32_t hblock_id;
+	bool hblock_ended;
+	/*The block is the trailers of a request body, on a stream already started*/
+	bool hblock_trailers;
+	/*Either side sent a GOAWAY, the connection closes once its streams are done*/
+	bool goaway;
+	/*Stream 1 is an Upgrade: h2c request cb_h2 has yet to answer*/
+	bool upgraded;
+
+	/*The DATA frame being sent, and where its header ends in outbuf.
+	  Frames queued after it wait for its payload.*/
+	client_data_t *sending;
+	size_t frame_left;
+	size_t frame_end;
+
+	unsigned char inbuf[9 + H2_FRAME_MAX];
+	size_t inlen;
+	unsigned char outbuf[H2_OUTBUF];
+	size_t outlen, outpos;
+};
+
+uint32_t h2_get32(const unsigned char *p)
+{
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+void h2_put32(unsigned char *p, uint32_t value)
+{
+	p[0] = value >> 24;
+	p[1] = value >> 16;
+	p[2] = value >> 8;
+	p[3] = value;
+}
+
+/*Appends a frame header to outbuf, the payload is up to the caller*/
+unsigned char *h2_frame(h2_conn_t *h2, size_t len, unsigned char type, unsigned char flags, uint32_t id)
+{
+	unsigned char *p;
+
+	p = h2->outbuf + h2->outlen;
+	p[0] = len >> 16;
+	p[1] = len >> 8;
+	p[2] = len;
+	p[3] = type;
+	p[4] = flags;
+	h2_put32(p + 5, id);
+	h2->outlen += 9 + len;
+
+	return p + 9;
+}
+
+/*Frames with a 4 byte payload: RST_STREAM and WINDOW_UPDATE*/
+void h2_frame32(h2_conn_t *h2, unsigned char type, uint32_t id, uint32_t value)
+{
+	h2_put32(h2_frame(h2, 4, type, 0, id), value);
+}
+
+void h2_goaway(h2_conn_t *h2, uint32_t code)
+{
+	unsigned char *p;
+
+	p = h2_frame(h2, 8, H2_GOAWAY, 0, 0);
+	h2_put32(p, h2->last_id);
+	h2_put32(p + 4, code);
+}
+
+h2_stream_t *h2_find(h2_conn_t *h2, uint32_t id)
+{
+	unsigned int i;
+
+	for (i = 0; i < h2->nstreams; i++) {
+		if (h2->streams[i].id == id)
+			return &h2->streams[i];
+	}
+
+	return NULL;
+}
+
+h2_stream_t *h2_find_cdata(h2_conn_t *h2, client_data_t *stream)
+{
+	unsigned int i;
+
+	for (i = 0; i < h2->nstreams; i++) {
+		if (h2->streams[i].cdata == stream)
+			return &h2->streams[i];
+	}
+
+	return NULL;
+}
+
+/*Applies SETTINGS from the client, returns an error code*/
+uint32_t h2_settings(h2_conn_t *h2, const unsigned char *p, size_t len)
+{
+	unsigned int i, id;
+	uint32_t value;
+
+	for (; len >= 6; p += 6, len -= 6) {
+		id    = (p[0] << 8) | p[1];
+		value = h2_get32(p + 2);
+
+		switch (id) {
+		/*SETTINGS_INITIAL_WINDOW_SIZE moves the windows of open streams too*/
+		case 4:
+			if (value > 0x7fffffff)
+				return H2_FLOW_CONTROL_ERROR;
+			for (i = 0; i < h2->nstreams; i++)
+				h2->streams[i].window += (int64_t)value - h2->initial_window;
+			h2->initial_window = value;
+			break;
+		/*SETTINGS_MAX_FRAME_SIZE*/
+		case 5:
+			if ((value < H2_FRAME_MAX) || (value > 0xffffff))
+				return H2_PROTOCOL_ERROR;
+			h2->max_frame = value;
+			break;
+		/*Our encoder doesn't use the table, and we don't push*/
+		default:
+			break;
+		}
+	}
+
+	return H2_NO_ERROR;
+}
+
+/*Applies the HTTP2-Settings field of an upgrade, base64url coded SETTINGS*/
+bool h2_upgrade_settings(h2_conn_t *h2, token value)
+{
+	unsigned char settings[96];
+	size_t i, len;
+	uint32_t bits;
+	unsigned int nbits;
+	int c;
+
+	len   = 0;
+	bits  = 0;
+	nbits = 0;
+	for (i = 0; i < value.len; i++) {
+		c = value.str[i];
+		if ((c >= 'A') && (c <= 'Z'))
+			c -= 'A';
+		else if ((c >= 'a') && (c <= 'z'))
+			c -= 'a' - 26;
+		else if ((c >= '0') && (c <= '9'))
+			c -= '0' - 52;
+		else if (c == '-')
+			c = 62;
+		else if (c == '_')
+			c = 63;
+		else if (c == '=')
+			break;
+		else
+			return false;
+
+		bits   = (bits << 6) | c;
+		nbits += 6;
+		if (nbits >= 8) {
+			nbits -= 8;
+			if (len >= sizeof(settings))
+				return false;
+			settings[len++] = bits >> nbits;
+		}
+	}
+
+	return !(len % 6) && (h2_settings(h2, settings, len) == H2_NO_ERROR);
+}
+
+/*Returns true for a request that asks to switch to HTTP/2 with Upgrade: h2c.
+  It has to be one without a body, since the body would come before the preface.*/
+bool h2_upgrade_wanted(client_data_t *cdata)
+{
+	size_t i;
+	bool h2c, settings;
+	token value;
+
+	if (!tokeq(cdata->tokens[0], "GET") && !tokeq(cdata->tokens[0], "HEAD"))
+		return false;
+
+	h2c = settings = false;
+	for (i = 3; (i+1) < cdata->tokenslen; i += 2) {
+		value = cdata->tokens[i+1];
+		if (tokcaseeq(cdata->tokens[i], "HTTP2-Settings"))
+			settings = true;
+		else if (tokcaseeq(cdata->tokens[i], "Upgrade") &&
+			 (value.len >= 3) && memmem(value.str, value.len, "h2c", 3))
+			h2c = true;
+	}
+
+	return h2c && settings;
+}
+
+/*Returns true for the request line of the prior knowledge preface*/
+bool h2_preface_wanted(client_data_t *cdata)
+{
+	return (cdata->tokenslen == 3) && tokeq(cdata->tokens[0], "PRI") &&
+	       tokeq(cdata->tokens[1], "*") && tokeq(cdata->tokens[2], "HTTP/2.0");
+}
+
+/*Hands a stream's slot back, with the file it was sending*/
+void h2_stream_free(client_data_t *stream, int efd)
+{
+	if (stream->file) {
+		fcache_release(stream->file);
+		stream->file = NULL;
+	}
+	stream->rfd = -1;
+	free_buffers(stream);
+	free_cdata(stream);
+
+	/*There is room for another client now*/
+	if (accept_paused)
+		accept_resume(efd);
+}
+
+/*Done with a stream, after its response is out or when the client resets it*/
+void h2_stream_close(client_data_t *cdata, h2_stream_t *s, int efd)
+{
+	h2_conn_t *h2;
+
+	h2 = cdata->h2;
+
+	/*The client may still be sending a body nobody is going to read*/
+	if (!s->ended && ((h2->outlen + 13) <= H2_OUTBUF))
+		h2_frame32(h2, H2_RST_STREAM, s->id, H2_NO_ERROR);
+
+	metrics_answered(s->cdata);
+	h2_stream_free(s->cdata, efd);
+	*s = h2->streams[--h2->nstreams];
+}
+
+/*Ends a stream before its response is done, the client reset it or it ran
+  into a stream error. A DATA frame that is halfway out still has to be finished.*/
+void h2_stream_reset(client_data_t *cdata, h2_stream_t *s, int efd)
+{
+	h2_conn_t *h2;
+
+	h2 = cdata->h2;
+
+	s->ended = true;
+	s->cdata->batched = 0;
+	if (h2->sending == s->cdata)
+		s->cdata->tosend = h2->frame_left;
+	else
+		h2_stream_close(cdata, s, efd);
+}
+
+/*Answers a stream whose request is in its tokens, gen_response renders the
+  header and hpack_encode turns it into a HEADERS frame. Streams aren't
+  proxied, requests under a proxy route get a 502 instead of a local file.*/
+void h2_respond(client_data_t *cdata, h2_stream_t *s, int efd)
+{
+	h2_conn_t *h2;
+	client_data_t *stream;
+	unsigned char *p;
+	size_t len;
+	bool body;
+
+	h2     = cdata->h2;
+	stream = s->cdata;
+
+	stream->responselen   = 0;
+	stream->response_sent = 0;
+	if (proxy_route(stream) >= 0) {
+		proxy_bad_gateway(stream);
+		stream->batched = 1;
+	} else
+		stream->batched = gen_response(stream);
+
+	/*A body from memory has readfile set too*/
+	body = stream->readfile && stream->tosend;
+	p    = h2->outbuf + h2->outlen + 9;
+	len  = hpack_encode(stream, p, H2_OUTBUF - h2->outlen - 9 - 13);
+	if (!len) {
+		/*Can't happen with H2_RESPONSE_ROOM, but the stream goes either way*/
+		s->ended = true;
+		h2_frame32(h2, H2_RST_STREAM, s->id, H2_INTERNAL_ERROR);
+		body = false;
+	} else
+		h2_frame(h2, len, H2_HEADERS, H2_END_HEADERS | (body ? 0 : H2_END_STREAM), s->id);
+
+	/*The tokens, request and response aren't needed anymore*/
+	free_buffers(stream);
+	wmetrics->h2_streams++;
+
+	if (!body)
+		h2_stream_close(cdata, s, efd);
+}
+
+/*Starts a stream for a complete request header block*/
+bool h2_request(client_data_t *cdata, uint32_t id, const unsigned char *block, size_t len,
+		bool ended, int efd)
+{
+	h2_conn_t *h2;
+	h2_stream_t *s;
+	client_data_t *stream;
+
+	h2 = cdata->h2;
+
+	/*The block still has to go through the table, to keep it in step*/
+	if (h2->goaway || (h2->nstreams >= H2_MAX_STREAMS) || !(stream = alloc_cdata())) {
+		if (!hpack_decode(&h2->table, NULL, block, len))
+			return false;
+		h2_frame32(h2, H2_RST_STREAM, id, H2_REFUSED_STREAM);
+		return true;
+	}
+
+	alloc_buffers(stream);
+	/*The connection's fd, only for metrics_local, streams aren't in epoll*/
+	stream->fd        = cdata->fd;
+	stream->rfd       = -1;
+	stream->file      = NULL;
+	stream->body      = NULL;
+	stream->readfile  = false;
+	stream->tosend    = 0;
+	stream->keepalive = true;
+	stream->cb_func   = NULL;
+	stream->started   = metrics_clock();
+	stream->batched   = 0;
+
+	if (!hpack_decode(&h2->table, stream, block, len)) {
+		h2_stream_free(stream, efd);
+		return false;
+	}
+
+	/*Requests need a method and a path*/
+	if (!stream->tokens[0].len || !stream->tokens[1].len) {
+		h2_stream_free(stream, efd);
+		h2_frame32(h2, H2_RST_STREAM, id, H2_PROTOCOL_ERROR);
+		return true;
+	}
+
+	s         = &h2->streams[h2->nstreams++];
+	s->cdata  = stream;
+	s->id     = id;
+	s->window = h2->initial_window;
+	s->ended  = ended;
+	timer_arm(cdata, TIMER_SEND);
+
+	h2_respond(cdata, s, efd);
+	return true;
+}
+
+/*Takes the trailers of a request body, they still have to go through the
+  table and are dropped after, like the body. Streams that are closed already
+  ignore them, the client may have sent them before it saw our RST_STREAM.*/
+bool h2_trailers(client_data_t *cdata, uint32_t id, const unsigned char *block, size_t len,
+		 bool ended, int efd)
+{
+	h2_conn_t *h2;
+	h2_stream_t *s;
+
+	h2 = cdata->h2;
+
+	if (!hpack_decode(&h2->table, NULL, block, len))
+		return false;
+
+	/*Trailers end the request, a stream that goes on after them is malformed*/
+	if ((s = h2_find(h2, id)) && !s->ended) {
+		if (ended)
+			s->ended = true;
+		else {
+			h2_frame32(h2, H2_RST_STREAM, id, H2_PROTOCOL_ERROR);
+			h2_stream_reset(cdata, s, efd);
+		}
+	}
+
+	return true;
+}
+
+/*Handles a HEADERS or CONTINUATION frame, returns an error code*/
+uint32_t h2_headers(client_data_t *cdata, unsigned char type, unsigned char flags, uint32_t id,
+		    unsigned char *p, size_t len, int efd)
+{
+	h2_conn_t *h2;
+	size_t pad;
+	bool trailers, ok;
+
+	h2 = cdata->h2;
+
+	if (type == H2_CONTINUATION) {
+		if (!h2->hblock || (id != h2->hblock_id))
+			return H2_PROTOCOL_ERROR;
+		if ((h2->hblocklen + len) > H2_FRAME_MAX)
+			return H2_COMPRESSION_ERROR;
+
+		memcpy(h2->hblock + h2->hblocklen, p, len);
+		h2->hblocklen += len;
+		if (!(flags & H2_END_HEADERS))
+			return H2_NO_ERROR;
+
+		p   = h2->hblock;
+		len = h2->hblocklen;
+		h2->hblock = NULL;
+		if (h2->hblock_trailers)
+			ok = h2_trailers(cdata, id, p, len, h2->hblock_ended, efd);
+		else
+			ok = h2_request(cdata, id, p, len, h2->hblock_ended, efd);
+		free(p);
+		return ok ? H2_NO_ERROR : H2_COMPRESSION_ERROR;
+	}
+
+	if (!(id & 1))
+		return H2_PROTOCOL_ERROR;
+	/*A block on a stream the client has started already carries trailers*/
+	trailers = id <= h2->last_id;
+	if (!trailers)
+		h2->last_id = id;
+
+	pad = 0;
+	if (flags & H2_PADDED) {
+		if (!len)
+			return H2_PROTOCOL_ERROR;
+		pad = *p++;
+		len--;
+	}
+	if (flags & H2_PRIO) {
+		if (len < 5)
+			return H2_PROTOCOL_ERROR;
+		p   += 5;
+		len -= 5;
+	}
+	if (pad > len)
+		return H2_PROTOCOL_ERROR;
+	len -= pad;
+
+	/*The rest of the block comes in CONTINUATION frames*/
+	if (!(flags & H2_END_HEADERS)) {
+		h2->hblock          = palloc(H2_FRAME_MAX, 1);
+		h2->hblocklen       = len;
+		h2->hblock_id       = id;
+		h2->hblock_ended    = flags & H2_END_STREAM;
+		h2->hblock_trailers = trailers;
+		memcpy(h2->hblock, p, len);
+		return H2_NO_ERROR;
+	}
+
+	if (trailers)
+		ok = h2_trailers(cdata, id, p, len, flags & H2_END_STREAM, efd);
+	else
+		ok = h2_request(cdata, id, p, len, flags & H2_END_STREAM, efd);
+	return ok ? H2_NO_ERROR : H2_COMPRESSION_ERROR;
+}
+
+/*Handles one complete frame other than DATA, returns an error code*/
+uint32_t h2_control(client_data_t *cdata, unsigned char type, unsigned char flags, uint32_t id,
+		    unsigned char *p, size_t len, int efd)
+{
+	h2_conn_t *h2;
+	h2_stream_t *s;
+	uint32_t value;
+
+	h2 = cdata->h2;
+
+	/*Nothing may come between the frames of a header block*/
+	if (h2->hblock && (type != H2_CONTINUATION))
+		return H2_PROTOCOL_ERROR;
+
+	switch (type) {
+	case H2_HEADERS:
+	case H2_CONTINUATION:
+		return h2_headers(cdata, type, flags, id, p, len, efd);
+	case H2_RST_STREAM:
+		if (len != 4)
+			return H2_FRAME_SIZE_ERROR;
+		if ((s = h2_find(h2, id)))
+			h2_stream_reset(cdata, s, efd);
+		break;
+	case H2_SETTINGS:
+		if (id || (len % 6))
+			return H2_PROTOCOL_ERROR;
+		if (flags & H2_ACK)
+			break;
+		if ((value = h2_settings(h2, p, len)))
+			return value;
+		h2_frame(h2, 0, H2_SETTINGS, H2_ACK, 0);
+		break;
+	case H2_PING:
+		if (len != 8)
+			return H2_FRAME_SIZE_ERROR;
+		if (!(flags & H2_ACK))
+			memcpy(h2_frame(h2, 8, H2_PING, H2_ACK, 0), p, 8);
+		break;
+	case H2_GOAWAY:
+		h2->goaway = true;
+		break;
+	case H2_WINDOW_UPDATE:
+		if (len != 4)
+			return H2_FRAME_SIZE_ERROR;
+		value = h2_get32(p) & 0x7fffffff;
+		if (!value && !id)
+			return H2_PROTOCOL_ERROR;
+		if (!id) {
+			h2->window += value;
+			if (h2->window > 0x7fffffff)
+				return H2_FLOW_CONTROL_ERROR;
+		} else if ((s = h2_find(h2, id))) {
+			/*Only the stream is at fault, the others go on*/
+			s->window += value;
+			if (s->window > 0x7fffffff) {
+				h2_frame32(h2, H2_RST_STREAM, id, H2_FLOW_CONTROL_ERROR);
+				h2_stream_reset(cdata, s, efd);
+			}
+		}
+		break;
+	case H2_PUSH_PROMISE:
+		return H2_PROTOCOL_ERROR;
+	/*PRIORITY and unknown frame types are ignored*/
+	default:
+		break;
+	}
+
+	return H2_NO_ERROR;
+}
+
+/*Handles the frames in inbuf, as far as there is room in outbuf for what
+  they queue. Returns H2_DONE, H2_BLOCKED, or H2_FAIL after queuing a GOAWAY.*/
+int h2_input(client_data_t *cdata, int efd)
+{
+	h2_conn_t *h2;
+	h2_stream_t *s;
+	size_t pos, n, len;
+	unsigned char *p, type, flags;
+	uint32_t id, error;
+	int ret;
+
+	h2  = cdata->h2;
+	pos = 0;
+	ret = H2_DONE;
+
+	/*The client preface, or what parse_request left of it*/
+	if (h2->preface < (sizeof(h2_preface) - 1)) {
+		n = sizeof(h2_preface) - 1 - h2->preface;
+		n = (h2->inlen < n) ? h2->inlen : n;
+		if (memcmp(h2->inbuf, h2_preface + h2->preface, n))
+			return H2_FAIL;
+		h2->preface += n;
+		pos          = n;
+	}
+
+	while (h2->preface == (sizeof(h2_preface) - 1)) {
+		/*The rest of a DATA frame's payload*/
+		if (h2->skip) {
+			n = h2->inlen - pos;
+			n = (h2->skip < n) ? h2->skip : n;
+			h2->skip -= n;
+			pos      += n;
+			if (h2->skip)
+				break;
+		}
+
+		if ((h2->inlen - pos) < 9)
+			break;
+
+		p     = h2->inbuf + pos;
+		len   = (p[0] << 16) | (p[1] << 8) | p[2];
+		type  = p[3];
+		flags = p[4];
+		id    = h2_get32(p + 5) & 0x7fffffff;
+		if (len > H2_FRAME_MAX) {
+			h2_goaway(h2, H2_FRAME_SIZE_ERROR);
+			return H2_FAIL;
+		}
+
+		if ((h2->outlen + ((type == H2_HEADERS || type == H2_CONTINUATION) ?
+				   H2_RESPONSE_ROOM : H2_CONTROL_ROOM)) > H2_OUTBUF) {
+			ret = H2_BLOCKED;
+			break;
+		}
+
+		/*Request bodies are dropped as they come in, and given back to
+		  the connection's window right away so the client can go on*/
+		if (type == H2_DATA) {
+			if (h2->hblock || !id) {
+				h2_goaway(h2, H2_PROTOCOL_ERROR);
+				return H2_FAIL;
+			}
+			if ((flags & H2_END_STREAM) && (s = h2_find(h2, id)))
+				s->ended = true;
+			if (len)
+				h2_frame32(h2, H2_WINDOW_UPDATE, 0, len);
+			h2->skip = len;
+			pos     += 9;
+			continue;
+		}
+
+		/*Everything else is handled once it is in whole*/
+		if ((h2->inlen - pos) < (9 + len))
+			break;
+
+		if ((error = h2_control(cdata, type, flags, id, p + 9, len, efd))) {
+			h2_goaway(h2, error);
+			return H2_FAIL;
+		}
+		pos += 9 + len;
+	}
+
+	h2->inlen -= pos;
+	memmove(h2->inbuf, h2->inbuf + pos, h2->inlen);
+
+	return ret;
+}
+
+/*Queues the header of the next DATA frame, the streams with a body left
+  take turns a frame at a time. Returns false if none of them can send.*/
+bool h2_next_data(h2_conn_t *h2)
+{
+	unsigned int i, n;
+	h2_stream_t *s;
+	size_t len;
+
+	if (h2->window <= 0)
+		return false;
+
+	for (i = 0; i < h2->nstreams; i++) {
+		n = (h2->turn + i) % h2->nstreams;
+		s = &h2->streams[n];
+		if ((s->window <= 0) || !s->cdata->tosend)
+			continue;
+
+		len = s->cdata->tosend;
+		len = (len < h2->max_frame) ? len : h2->max_frame;
+		len = ((int64_t)len < h2->window) ? len : (size_t)h2->window;
+		len = ((int64_t)len < s->window) ? len : (size_t)s->window;
+
+		/*The payload doesn't go through outbuf, only the header does*/
+		h2_frame(h2, len, H2_DATA, (len == s->cdata->tosend) ? H2_END_STREAM : 0, s->id);
+		h2->outlen -= len;
+
+		h2->window    -= len;
+		s->window     -= len;
+		h2->sending    = s->cdata;
+		h2->frame_left = len;
+		h2->frame_end  = h2->outlen;
+		h2->turn       = n + 1;
+		return true;
+	}
+
+	return false;
+}
+
+/*Sends outbuf and the DATA frames, a send budget at a time like cb_sendfile*/
+int h2_output(client_data_t *cdata, int efd)
+{
+	h2_conn_t *h2;
+	client_data_t *stream;
+	ssize_t ret;
+	size_t budget, end;
+
+	h2     = cdata->h2;
+	budget = send_budget;
+
+	while (true) {
+		/*Up to the header of the DATA frame being sent, which is held back for its payload*/
+		end = h2->frame_left ? h2->frame_end : h2->outlen;
+		if (h2->outpos < end) {
+			ret = send(cdata->fd, h2->outbuf + h2->outpos, end - h2->outpos,
+				   h2->frame_left ? MSG_MORE : 0);
+			if (would_block(ret)) {
+				wmetrics->eagain_send++;
+				return H2_WAIT;
+			}
+			if (ret <= 0)
+				return H2_FAIL;
+
+			h2->outpos             += ret;
+			wmetrics->bytes_header += ret;
+			timer_arm(cdata, TIMER_SEND);
+			continue;
+		}
+		if (h2->outpos == h2->outlen)
+			h2->outpos = h2->outlen = h2->frame_end = 0;
+
+		if (h2->frame_left) {
+			stream = h2->sending;
+			if (stream->body)
+				ret = send(cdata->fd, stream->body, h2->frame_left, 0);
+			else
+				ret = sendfile(cdata->fd, stream->rfd, &stream->offset, h2->frame_left);
+			if (would_block(ret)) {
+				wmetrics->eagain_send++;
+				return H2_WAIT;
+			}
+			if (ret <= 0)
+				return H2_FAIL;
+
+			if (stream->body) {
+				stream->body           += ret;
+				wmetrics->bytes_memory += ret;
+			} else
+				wmetrics->bytes_sendfile += ret;
+			stream->tosend  -= ret;
+			h2->frame_left  -= ret;
+			budget          -= ((size_t)ret < budget) ? (size_t)ret : budget;
+			timer_arm(cdata, TIMER_SEND);
+
+			if (!h2->frame_left) {
+				h2->sending = NULL;
+				if (!stream->tosend)
+					h2_stream_close(cdata, h2_find_cdata(h2, stream), efd);
+			}
+			continue;
+		}
+
+		if (!h2_next_data(h2))
+			return H2_DONE;
+		/*The others get their turn, see cb_sendfile*/
+		if (!budget)
+			return H2_YIELD;
+	}
+}
+
+/*Switches a connection to HTTP/2, after the request at the front of the
+  request buffer, the preface's request line or an Upgrade: h2c request.
+  The upgrade request becomes stream 1, which cb_h2 answers first.*/
+bool h2_start(client_data_t *cdata, bool upgrade)
+{
+	unsigned int i;
+	size_t requestlen;
+	h2_conn_t *h2;
+	h2_stream_t *s;
+	client_data_t *stream;
+	unsigned char *p;
+
+	h2 = palloc(sizeof(h2_conn_t), 1);
+	hpack_table_init(&h2->table);
+	h2->window         = 65535;
+	h2->initial_window = 65535;
+	h2->max_frame      = H2_FRAME_MAX;
+	h2->preface        = upgrade ? 0 : h2_preface_request;
+	cdata->h2          = h2;
+
+	if (upgrade) {
+		memcpy(h2->outbuf, h2_switching, sizeof(h2_switching) - 1);
+		h2->outlen = sizeof(h2_switching) - 1;
+
+		for (i = 3; (i+1) < cdata->tokenslen; i += 2) {
+			if (tokcaseeq(cdata->tokens[i], "HTTP2-Settings") &&
+			    !h2_upgrade_settings(h2, cdata->tokens[i+1]))
+				return false;
+		}
+	}
+
+	/*SETTINGS_MAX_CONCURRENT_STREAMS and SETTINGS_MAX_HEADER_LIST_SIZE*/
+	p = h2_frame(h2, 12, H2_SETTINGS, 0, 0);
+	p[0] = 0;
+	p[1] = 3;
+	h2_put32(p + 2, H2_MAX_STREAMS);
+	p[6] = 0;
+	p[7] = 6;
+	h2_put32(p + 8, headerlen);
+
+	requestlen = cdata->parse_pos;
+	if (upgrade)
+		h2->last_id = 1;
+	if (upgrade && !(stream = alloc_cdata()))
+		h2_frame32(h2, H2_RST_STREAM, 1, H2_REFUSED_STREAM);
+	else if (upgrade) {
+		/*The request moves over to the stream as it is, tokens and all*/
+		alloc_buffers(stream);
+		memcpy(stream->request, cdata->request, requestlen);
+		for (i = 0; i < cdata->tokenslen; i++) {
+			stream->tokens[i].str = stream->request + (cdata->tokens[i].str - cdata->request);
+			stream->tokens[i].len = cdata->tokens[i].len;
+		}
+		stream->tokenslen = cdata->tokenslen;
+		stream->fd        = cdata->fd;
+		stream->rfd       = -1;
+		stream->file      = NULL;
+		stream->body      = NULL;
+		stream->readfile  = false;
+		stream->tosend    = 0;
+		stream->keepalive = true;
+		stream->cb_func   = NULL;
+		stream->started   = cdata->started;
+		stream->batched   = 0;
+
+		s            = &h2->streams[h2->nstreams++];
+		s->cdata     = stream;
+		s->id        = 1;
+		s->window    = h2->initial_window;
+		s->ended     = true;
+		h2->upgraded = true;
+	}
+
+	/*What came after the request is already HTTP/2*/
+	h2->inlen = cdata->request_recvd - requestlen;
+	memcpy(h2->inbuf, cdata->request + requestlen, h2->inlen);
+	cdata->request_recvd = 0;
+	parse_reset(cdata);
+	free_buffers(cdata);
+
+	cdata->batched = 0;
+	cdata->cb_func = cb_h2;
+	/*Reading and writing go on side by side from now on*/
+	cdata->waiting = EPOLLIN | EPOLLOUT;
+	wmetrics->h2_conns++;
+
+	return true;
+}
+
+/*Callback of an HTTP/2 connection, for both directions: reads frames and
+  handles them, then sends what they queued and the DATA frames, until
+  neither can go on*/
+bool cb_h2(client_data_t *cdata, int efd)
+{
+	h2_conn_t *h2;
+	ssize_t ret;
+	int in, out;
+	bool full;
+
+	h2 = cdata->h2;
+	cdata->waiting = EPOLLIN | EPOLLOUT;
+
+	if (h2->upgraded) {
+		h2->upgraded = false;
+		h2_respond(cdata, &h2->streams[0], efd);
+	}
+
+	while (true) {
+		while (h2->inlen < sizeof(h2->inbuf)) {
+			ret = recv(cdata->fd, h2->inbuf + h2->inlen, sizeof(h2->inbuf) - h2->inlen, 0);
+			if (would_block(ret)) {
+				wmetrics->eagain_recv++;
+				break;
+			}
+			if (ret <= 0) {
+				close_client(cdata, efd);
+				return false;
+			}
+			h2->inlen += ret;
+		}
+		full = (h2->inlen == sizeof(h2->inbuf));
+
+		in = h2_input(cdata, efd);
+		/*The GOAWAY gets one try, unless it would land in a DATA frame's payload*/
+		if (in == H2_FAIL) {
+			if (!h2->frame_left)
+				send(cdata->fd, h2->outbuf + h2->outpos, h2->outlen - h2->outpos, MSG_DONTWAIT);
+			close_client(cdata, efd);
+			return false;
+		}
+
+		out = h2_output(cdata, efd);
+		if (out == H2_FAIL) {
+			close_client(cdata, efd);
+			return false;
+		}
+		if (out == H2_YIELD) {
+			cdata->waiting = 0;
+			ready_push(cdata);
+			wmetrics->send_yields++;
+			return false;
+		}
+
+		/*Frames that waited for room in outbuf, or more to read after a full inbuf*/
+		if ((in == H2_BLOCKED) ? (out == H2_DONE) : (full && (h2->inlen < sizeof(h2->inbuf))))
+			continue;
+		break;
+	}
+
+	if (!h2->nstreams && !h2->outlen) {
+		if (h2->goaway) {
+			close_client(cdata, efd);
+			return false;
+		}
+		if (cdata->tkind != TIMER_IDLE)
+			timer_arm(cdata, TIMER_IDLE);
+	}
+
+	return false;
+}
+
+/*Sends a GOAWAY for a draining worker, the client opens its next streams
+  elsewhere and the connection closes once the ones it has are done*/
+void h2_drain(client_data_t *cdata, int efd)
+{
+	h2_conn_t *h2;
+
+	h2 = cdata->h2;
+	if (h2->goaway)
+		return;
+	h2->goaway = true;
+
+	if ((h2->outlen + H2_CONTROL_ROOM) <= H2_OUTBUF)
+		h2_goaway(h2, H2_NO_ERROR);
+	/*One waiting for its turn on the ready queue sends it then*/
+	if (!cdata->rprev)
+		while (cdata->cb_func(cdata, efd));
+}
+
+/*Called by close_client, closes the streams of an HTTP/2 connection*/
+void h2_close(client_data_t *cdata, int efd)
+{
+	h2_conn_t *h2;
+	unsigned int i;
+
+	if (!(h2 = cdata->h2))
+		return;
+
+	for (i = 0; i < h2->nstreams; i++)
+		h2_stream_free(h2->streams[i].cdata, efd);
+	free(h2->hblock);
+	free(h2);
+	cdata->h2 = NULL;
+}
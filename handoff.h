@@ -0,0 +1,253 @@
+/*Listening sockets, and restarts that don't drop connections.
+  A new httpc started with -u picks the sockets up from the running one over
+  a unix socket with SCM_RIGHTS, so connections keep queueing on them while
+  the old process drains. Sockets passed by systemd socket activation are
+  taken the same way, with LISTEN_FDS.*/
+
+/*First descriptor socket activation passes*/
+#define LISTEN_FDS_START 3
+/*Descriptors sent per handoff message, the kernel takes up to 253*/
+#define HANDOFF_BATCH 64
+
+/*Path of the unix socket the listening sockets are handed over on, set with -u*/
+const char *handoff_path = NULL;
+
+/*The listening sockets, one per worker unless they were inherited.
+  Workers past nlisten share them with a dup of their own.*/
+int *listen_fds;
+unsigned int nlisten;
+
+/*Checks an inherited descriptor, and makes it nonblocking for the event loops*/
+void listen_adopt(int fd)
+{
+	int accepting, flags;
+	socklen_t len;
+
+	len = sizeof(accepting);
+	if ((getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &accepting, &len) < 0) || !accepting)
+		die("Inherited descriptor %d isn't a listening socket\n", fd);
+
+	if (((flags = fcntl(fd, F_GETFL)) < 0) || (fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) ||
+	    (fcntl(fd, F_SETFD, FD_CLOEXEC) < 0))
+		die("Failed to set up inherited socket %d\n", fd);
+}
+
+/*Takes the sockets systemd passed in, returns false if there are none*/
+bool listen_inherit(void)
+{
+	char *pid, *fds;
+	unsigned int i;
+
+	pid = getenv("LISTEN_PID");
+	fds = getenv("LISTEN_FDS");
+	if (!pid || !fds || (strtol(pid, NULL, 10) != getpid()))
+		return false;
+	nlisten = (unsigned int)strtoul(fds, NULL, 10);
+
+	/*They are meant for this process only, not for the ones it starts*/
+	unsetenv("LISTEN_PID");
+	unsetenv("LISTEN_FDS");
+	unsetenv("LISTEN_FDNAMES");
+
+	if (!nlisten)
+		return false;
+
+	listen_fds = palloc(sizeof(int), nlisten);
+	for (i = 0; i < nlisten; i++) {
+		listen_fds[i] = LISTEN_FDS_START + i;
+		listen_adopt(listen_fds[i]);
+	}
+
+	return true;
+}
+
+/*Creates a listening socket per worker, bound to the same port with SO_REUSEPORT
+  so the kernel spreads incoming connections between them*/
+void listen_create(void)
+{
+	unsigned int i;
+	int lsock;
+
+	nlisten    = nworkers;
+	listen_fds = palloc(sizeof(int), nlisten);
+	for (i = 0; i < nlisten; i++) {
+		lsock = create_sock(IPANY, "8081", false);
+			/*8081 is a good port number, since 8080 is likely to be taken*/
+		if (lsock < 0)
+			die("Failed to create listen socket\n");
+
+		/*Lets connections sit in the kernel until their request starts coming in,
+		  so accepting one is followed by a receive that has something to read*/
+		if ((defer_accept > 0) &&
+		    setsockopt(lsock, IPPROTO_TCP, TCP_DEFER_ACCEPT, &defer_accept, sizeof(defer_accept)) < 0)
+			die("Failed to set TCP_DEFER_ACCEPT\n");
+
+		/*A short backlog drops SYNs when connections come in bursts*/
+		if (listen(lsock, listen_backlog))
+			die("Failed to put socket into listen mode\n");
+
+		listen_fds[i] = lsock;
+	}
+}
+
+/*Gives the worker a listening socket of its own to close*/
+int listen_worker(unsigned int id)
+{
+	int lsock;
+
+	if (id < nlisten)
+		return listen_fds[id];
+
+	if ((lsock = fcntl(listen_fds[id % nlisten], F_DUPFD_CLOEXEC, 0)) < 0)
+		die("Failed to share a listening socket\n");
+	return lsock;
+}
+
+/*Returns a unix socket, and fills in addr with path*/
+int handoff_socket(const char *path, struct sockaddr_un *addr)
+{
+	int usock;
+
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr->sun_path))
+		die("Handoff socket path is too long\n");
+	strcpy(addr->sun_path, path);
+
+	if ((usock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+		die("Failed to create handoff socket\n");
+	return usock;
+}
+
+/*Asks the httpc running at path for its listening sockets,
+  returns false if there isn't one*/
+bool handoff_receive(const char *path)
+{
+	int usock;
+	uint32_t total;
+	unsigned int n;
+	struct sockaddr_un addr;
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	union {
+		char buf[CMSG_SPACE(sizeof(int) * HANDOFF_BATCH)];
+		struct cmsghdr align;
+	} control;
+
+	usock = handoff_socket(path, &addr);
+	if (connect(usock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		close(usock);
+		return false;
+	}
+
+	/*Every message has the total, and a batch of the sockets*/
+	nlisten = 0;
+	do {
+		iov.iov_base = &total;
+		iov.iov_len  = sizeof(total);
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov        = &iov;
+		msg.msg_iovlen     = 1;
+		msg.msg_control    = control.buf;
+		msg.msg_controllen = sizeof(control.buf);
+		if ((recvmsg(usock, &msg, MSG_CMSG_CLOEXEC) != sizeof(total)) ||
+		    (msg.msg_flags & MSG_CTRUNC) || !total)
+			die("Failed to receive the listening sockets from %s\n", path);
+
+		if (!listen_fds)
+			listen_fds = palloc(sizeof(int), total);
+
+		n = 0;
+		for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+			if ((cmsg->cmsg_level != SOL_SOCKET) || (cmsg->cmsg_type != SCM_RIGHTS))
+				continue;
+			n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			if (!n || ((nlisten + n) > total))
+				die("Failed to receive the listening sockets from %s\n", path);
+			memcpy(listen_fds + nlisten, CMSG_DATA(cmsg), n * sizeof(int));
+			nlisten += n;
+		}
+		if (!n)
+			die("Failed to receive the listening sockets from %s\n", path);
+	} while (nlisten < total);
+
+	/*Hanging up tells the old process it can stop accepting*/
+	close(usock);
+
+	for (n = 0; n < nlisten; n++)
+		listen_adopt(listen_fds[n]);
+
+	return true;
+}
+
+/*Opens the unix socket the next restart picks the listening sockets up from,
+  in place of the one the previous process had*/
+int handoff_listen(const char *path)
+{
+	int usock;
+	struct sockaddr_un addr;
+
+	usock = handoff_socket(path, &addr);
+	unlink(path);
+	if ((bind(usock, (struct sockaddr *)&addr, sizeof(addr)) < 0) || (listen(usock, 1) < 0))
+		die("Failed to open handoff socket %s\n", path);
+
+	return usock;
+}
+
+/*Sends the listening sockets to the process that connected to the handoff
+  socket, returns true once it has all of them*/
+bool handoff_send(int usock)
+{
+	int conn;
+	uint32_t total;
+	unsigned int i, n;
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	struct timeval timeout;
+	ssize_t ret;
+	union {
+		char buf[CMSG_SPACE(sizeof(int) * HANDOFF_BATCH)];
+		struct cmsghdr align;
+	} control;
+
+	if ((conn = accept4(usock, NULL, NULL, SOCK_CLOEXEC)) < 0)
+		return false;
+
+	total = nlisten;
+	for (i = 0; i < nlisten; i += n) {
+		n = ((nlisten - i) < HANDOFF_BATCH) ? (nlisten - i) : HANDOFF_BATCH;
+
+		iov.iov_base = &total;
+		iov.iov_len  = sizeof(total);
+		memset(&msg, 0, sizeof(msg));
+		memset(&control, 0, sizeof(control));
+		msg.msg_iov        = &iov;
+		msg.msg_iovlen     = 1;
+		msg.msg_control    = control.buf;
+		msg.msg_controllen = CMSG_SPACE(sizeof(int) * n);
+
+		cmsg             = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type  = SCM_RIGHTS;
+		cmsg->cmsg_len   = CMSG_LEN(sizeof(int) * n);
+		memcpy(CMSG_DATA(cmsg), listen_fds + i, sizeof(int) * n);
+
+		if (sendmsg(conn, &msg, MSG_NOSIGNAL) != sizeof(total)) {
+			close(conn);
+			return false;
+		}
+	}
+
+	/*Waits for the new process to hang up after taking them, a stuck one
+	  leaves this process serving. Both accepting for a while does no harm.*/
+	timeout.tv_sec  = 5;
+	timeout.tv_usec = 0;
+	setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	ret = recv(conn, &total, sizeof(total), 0);
+	close(conn);
+
+	return !ret;
+}
@@ -0,0 +1,106 @@
+/*Latency histogram in the style of HdrHistogram: values are counted in
+  buckets that grow with the value, so every value is kept to within 1/64th
+  of itself no matter how large it is, in a fixed amount of memory.*/
+/*Values below HIST_SUB are counted exactly. Above that, each power of two is
+  split into HIST_SUB/2 buckets, picked by the bits right below the top one.*/
+
+#define HIST_SUB_BITS 7
+#define HIST_SUB      (1u << HIST_SUB_BITS)
+#define HIST_HALF     (HIST_SUB / 2)
+/*Enough buckets for any 64 bit value*/
+#define HIST_BUCKETS  (HIST_SUB + (64 - HIST_SUB_BITS) * HIST_HALF)
+
+typedef struct {
+	uint64_t counts[HIST_BUCKETS];
+	uint64_t total;
+	uint64_t min;
+	uint64_t max;
+}hist_t;
+
+void hist_init(hist_t *hist)
+{
+	memset(hist, 0, sizeof(*hist));
+	hist->min = UINT64_MAX;
+}
+
+/*Returns the bucket value falls in*/
+unsigned int hist_bucket(uint64_t value)
+{
+	unsigned int shift;
+
+	if (value < HIST_SUB)
+		return (unsigned int)value;
+
+	/*Shifts the top bit down to bit HIST_SUB_BITS-1, the rest is the sub-bucket*/
+	shift = (63 - __builtin_clzll(value)) - (HIST_SUB_BITS - 1);
+	return HIST_SUB + (shift - 1) * HIST_HALF + (unsigned int)((value >> shift) - HIST_HALF);
+}
+
+/*Returns the largest value counted in bucket*/
+uint64_t hist_highest(unsigned int bucket)
+{
+	unsigned int shift;
+	uint64_t top;
+
+	if (bucket < HIST_SUB)
+		return bucket;
+
+	shift = (bucket - HIST_SUB) / HIST_HALF + 1;
+	top   = (bucket - HIST_SUB) % HIST_HALF + HIST_HALF;
+	return ((top + 1) << shift) - 1;
+}
+
+/*Counts value count times*/
+void hist_record_n(hist_t *hist, uint64_t value, uint64_t count)
+{
+	hist->counts[hist_bucket(value)] += count;
+	hist->total += count;
+	if (value < hist->min)
+		hist->min = value;
+	if (value > hist->max)
+		hist->max = value;
+}
+
+void hist_record(hist_t *hist, uint64_t value)
+{
+	hist_record_n(hist, value, 1);
+}
+
+/*Adds the counts of src to dst, for merging the histograms of several threads*/
+void hist_merge(hist_t *dst, const hist_t *src)
+{
+	unsigned int i;
+
+	for (i = 0; i < HIST_BUCKETS; i++)
+		dst->counts[i] += src->counts[i];
+
+	dst->total += src->total;
+	if (src->min < dst->min)
+		dst->min = src->min;
+	if (src->max > dst->max)
+		dst->max = src->max;
+}
+
+/*Returns the value at or below which percentile percent of the values are,
+  as the highest value of its bucket, capped at the largest value recorded*/
+uint64_t hist_percentile(const hist_t *hist, double percentile)
+{
+	unsigned int i;
+	uint64_t rank, seen;
+
+	if (!hist->total)
+		return 0;
+
+	/*The rank of the value wanted, counting from 1*/
+	rank = (uint64_t)((percentile / 100.0) * hist->total + 0.5);
+	if (rank < 1)
+		rank = 1;
+
+	for (i = 0, seen = 0; i < HIST_BUCKETS; i++) {
+		seen += hist->counts[i];
+		if (seen >= rank)
+			return (hist_highest(i) < hist->max) ? hist_highest(i) : hist->max;
+	}
+
+	return hist->max;
+}
@@ -0,0 +1,535 @@
+/*HPACK, the header compression of HTTP/2 (rfc 7541), see h2.h.
+  Request header blocks are decoded straight into a stream's request buffer
+  and tokens, laid out the way parse_request leaves them, so gen_response
+  answers them like any other request. Responses are encoded without the
+  dynamic table, which costs a few bytes per field but means there is no
+  table of ours the client has to keep in step with.*/
+
+/*Size of the dynamic table the client may use, the default of
+  SETTINGS_HEADER_TABLE_SIZE, which isn't raised*/
+#define HPACK_TABLE_SIZE    4096
+/*Every entry counts its name and value plus 32 towards the size*/
+#define HPACK_TABLE_ENTRIES (HPACK_TABLE_SIZE / 32)
+/*Entries of the static table, index 0 isn't one*/
+#define HPACK_STATIC        62
+
+typedef struct {
+	const char *name, *value;
+}hpack_field_t;
+
+const hpack_field_t hpack_static[HPACK_STATIC] = {
+	{NULL, NULL},
+	{":authority", ""},
+	{":method", "GET"},
+	{":method", "POST"},
+	{":path", "/"},
+	{":path", "/index.html"},
+	{":scheme", "http"},
+	{":scheme", "https"},
+	{":status", "200"},
+	{":status", "204"},
+	{":status", "206"},
+	{":status", "304"},
+	{":status", "400"},
+	{":status", "404"},
+	{":status", "500"},
+	{"accept-charset", ""},
+	{"accept-encoding", "gzip, deflate"},
+	{"accept-language", ""},
+	{"accept-ranges", ""},
+	{"accept", ""},
+	{"access-control-allow-origin", ""},
+	{"age", ""},
+	{"allow", ""},
+	{"authorization", ""},
+	{"cache-control", ""},
+	{"content-disposition", ""},
+	{"content-encoding", ""},
+	{"content-language", ""},
+	{"content-length", ""},
+	{"content-location", ""},
+	{"content-range", ""},
+	{"content-type", ""},
+	{"cookie", ""},
+	{"date", ""},
+	{"etag", ""},
+	{"expect", ""},
+	{"expires", ""},
+	{"from", ""},
+	{"host", ""},
+	{"if-match", ""},
+	{"if-modified-since", ""},
+	{"if-none-match", ""},
+	{"if-range", ""},
+	{"if-unmodified-since", ""},
+	{"last-modified", ""},
+	{"link", ""},
+	{"location", ""},
+	{"max-forwards", ""},
+	{"proxy-authenticate", ""},
+	{"proxy-authorization", ""},
+	{"range", ""},
+	{"referer", ""},
+	{"refresh", ""},
+	{"retry-after", ""},
+	{"server", ""},
+	{"set-cookie", ""},
+	{"strict-transport-security", ""},
+	{"transfer-encoding", ""},
+	{"user-agent", ""},
+	{"vary", ""},
+	{"via", ""},
+	{"www-authenticate", ""},
+};
+
+/*Length of the Huffman code of every byte and of EOS, the code is
+  canonical so the codes themselves follow from the lengths*/
+const unsigned char hpack_huff_len[257] = {
+	13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+	28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+	6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+	5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+	13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+	7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+	15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+	6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+	20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+	24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+	22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+	21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+	26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+	19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+	20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+	26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+	30
+};
+
+/*Built by hpack_init: the symbols in the order of their codes, and for every
+  code length the first code, where its symbols start and how many there are*/
+unsigned short hpack_huff_sym[257];
+uint32_t hpack_huff_first[31];
+unsigned short hpack_huff_index[31];
+unsigned short hpack_huff_count[31];
+
+/*The decoder's dynamic table, one per connection*/
+typedef struct {
+	/*Names and values back to back, oldest entry first*/
+	char data[HPACK_TABLE_SIZE];
+	struct {
+		unsigned short pos, namelen, valuelen;
+	}entries[HPACK_TABLE_ENTRIES];
+	unsigned int count;
+	/*Bytes of data in use, the size as counted by the rfc, and the most it may be*/
+	size_t used, size, max;
+}hpack_table_t;
+
+void hpack_init(void)
+{
+	unsigned int i, len, n;
+	uint32_t code;
+
+	memset(hpack_huff_count, 0, sizeof(hpack_huff_count));
+	for (i = 0; i < 257; i++)
+		hpack_huff_count[hpack_huff_len[i]]++;
+
+	for (len = 1, code = 0, n = 0; len <= 30; len++) {
+		hpack_huff_first[len] = code;
+		hpack_huff_index[len] = n;
+		code = (code + hpack_huff_count[len]) << 1;
+		n   += hpack_huff_count[len];
+	}
+
+	/*Symbols of the same length have consecutive codes, in symbol order*/
+	memset(hpack_huff_count, 0, sizeof(hpack_huff_count));
+	for (i = 0; i < 257; i++) {
+		len = hpack_huff_len[i];
+		hpack_huff_sym[hpack_huff_index[len] + hpack_huff_count[len]++] = i;
+	}
+}
+
+void hpack_table_init(hpack_table_t *table)
+{
+	table->count = 0;
+	table->used  = 0;
+	table->size  = 0;
+	table->max   = HPACK_TABLE_SIZE;
+}
+
+/*Drops the oldest entries until the table is no larger than size*/
+void hpack_evict(hpack_table_t *table, size_t size)
+{
+	unsigned int i;
+	size_t len;
+
+	while (table->count && (table->size > size)) {
+		len = table->entries[0].namelen + table->entries[0].valuelen;
+		table->used -= len;
+		table->size -= len + 32;
+		table->count--;
+
+		memmove(table->data, table->data + len, table->used);
+		memmove(table->entries, table->entries + 1, table->count * sizeof(table->entries[0]));
+		for (i = 0; i < table->count; i++)
+			table->entries[i].pos -= len;
+	}
+}
+
+/*Adds a field as the newest entry, an entry larger than the whole table
+  just empties it. name and value must not point into the table.*/
+void hpack_insert(hpack_table_t *table, const char *name, size_t namelen,
+		  const char *value, size_t valuelen)
+{
+	size_t size;
+
+	size = namelen + valuelen + 32;
+	if (size > table->max) {
+		hpack_evict(table, 0);
+		return;
+	}
+	hpack_evict(table, table->max - size);
+
+	memcpy(table->data + table->used, name, namelen);
+	memcpy(table->data + table->used + namelen, value, valuelen);
+	table->entries[table->count].pos      = table->used;
+	table->entries[table->count].namelen  = namelen;
+	table->entries[table->count].valuelen = valuelen;
+	table->count++;
+	table->used += namelen + valuelen;
+	table->size += size;
+}
+
+/*Looks up an index of the static table or, after it, of the dynamic table,
+  newest entry first. Returns false if there is no such entry.*/
+bool hpack_entry(hpack_table_t *table, size_t index, const char **name, size_t *namelen,
+		 const char **value, size_t *valuelen)
+{
+	unsigned int i;
+
+	if (!index)
+		return false;
+
+	if (index < HPACK_STATIC) {
+		*name     = hpack_static[index].name;
+		*namelen  = strlen(*name);
+		*value    = hpack_static[index].value;
+		*valuelen = strlen(*value);
+		return true;
+	}
+
+	index -= HPACK_STATIC;
+	if (index >= table->count)
+		return false;
+
+	i         = table->count - 1 - index;
+	*name     = table->data + table->entries[i].pos;
+	*namelen  = table->entries[i].namelen;
+	*value    = *name + *namelen;
+	*valuelen = table->entries[i].valuelen;
+	return true;
+}
+
+/*Reads an integer with an n bit prefix, false if it is cut off or too large*/
+bool hpack_int(const unsigned char **p, const unsigned char *end, int n, size_t *value)
+{
+	size_t mask;
+	unsigned int shift;
+	unsigned char b;
+
+	mask   = (1 << n) - 1;
+	*value = *(*p)++ & mask;
+	if (*value < mask)
+		return true;
+
+	shift = 0;
+	do {
+		if ((*p >= end) || (shift > 21))
+			return false;
+		b       = *(*p)++;
+		*value += (size_t)(b & 127) << shift;
+		shift  += 7;
+	} while (b & 128);
+
+	return true;
+}
+
+/*Decodes len bytes of Huffman code into out, false if they don't decode or don't fit*/
+bool hpack_huffman(const unsigned char *in, size_t len, char *out, size_t room, size_t *outlen)
+{
+	size_t i, n;
+	int bit;
+	unsigned int bits;
+	uint32_t code;
+	unsigned short sym;
+
+	code = 0;
+	bits = 0;
+	n    = 0;
+	for (i = 0; i < len; i++) {
+		for (bit = 7; bit >= 0; bit--) {
+			code = (code << 1) | ((in[i] >> bit) & 1);
+			if (++bits > 30)
+				return false;
+			if ((code - hpack_huff_first[bits]) >= hpack_huff_count[bits])
+				continue;
+
+			sym = hpack_huff_sym[hpack_huff_index[bits] + code - hpack_huff_first[bits]];
+			/*EOS only ever shows up as padding*/
+			if ((sym == 256) || (n >= room))
+				return false;
+			out[n++] = sym;
+			code = 0;
+			bits = 0;
+		}
+	}
+
+	/*Padding is the start of EOS, all ones, and shorter than a byte*/
+	if ((bits > 7) || (code != ((1u << bits) - 1)))
+		return false;
+
+	*outlen = n;
+	return true;
+}
+
+/*Reads a string literal into out*/
+bool hpack_string(const unsigned char **p, const unsigned char *end, char *out, size_t room, size_t *outlen)
+{
+	bool huffman;
+	size_t len;
+
+	if (*p >= end)
+		return false;
+
+	huffman = **p & 128;
+	if (!hpack_int(p, end, 7, &len) || (len > (size_t)(end - *p)))
+		return false;
+
+	if (huffman) {
+		if (!hpack_huffman(*p, len, out, room, outlen))
+			return false;
+	} else {
+		if (len > room)
+			return false;
+		memcpy(out, *p, len);
+		*outlen = len;
+	}
+
+	*p += len;
+	return true;
+}
+
+/*Records a decoded field in cdata's tokens. The pseudo header fields go in
+  the request line's tokens, :authority stands in for Host, and what doesn't
+  fit in the tokens is dropped like parse_token does.*/
+void hpack_token(client_data_t *cdata, char *name, size_t namelen, char *value, size_t valuelen)
+{
+	token *tok;
+
+	if (namelen && (name[0] == ':')) {
+		tok = NULL;
+		if ((namelen == 7) && !memcmp(name, ":method", 7))
+			tok = &cdata->tokens[0];
+		else if ((namelen == 5) && !memcmp(name, ":path", 5))
+			tok = &cdata->tokens[1];
+
+		if (tok) {
+			tok->str = value;
+			tok->len = valuelen;
+			return;
+		}
+
+		/*":authority" ends in the 4 bytes "host" needs*/
+		if ((namelen != 10) || memcmp(name, ":authority", 10))
+			return;
+		name    += 6;
+		namelen  = 4;
+		memcpy(name, "host", 4);
+	}
+
+	if ((cdata->tokenslen + 2) > maxtokens)
+		return;
+
+	cdata->tokens[cdata->tokenslen].str   = name;
+	cdata->tokens[cdata->tokenslen++].len = namelen;
+	cdata->tokens[cdata->tokenslen].str   = value;
+	cdata->tokens[cdata->tokenslen++].len = valuelen;
+}
+
+/*Decodes a header block into cdata's request buffer and tokens, or only into
+  the table if cdata is NULL, for blocks of streams that are refused. Returns
+  false if the block is malformed or too large, the table can't be trusted
+  after that so it ends the connection.*/
+bool hpack_decode(hpack_table_t *table, client_data_t *cdata, const unsigned char *in, size_t len)
+{
+	const unsigned char *p, *end;
+	const char *ename, *evalue;
+	char scratch[HPACK_TABLE_SIZE];
+	char *buf, *name, *value;
+	size_t pos, room, index, namelen, valuelen;
+	bool indexing;
+
+	if (cdata) {
+		buf  = cdata->request;
+		room = headerlen;
+
+		/*The request line, the version is never looked at past HTTP/1.0*/
+		cdata->tokens[0].str = cdata->tokens[1].str = buf;
+		cdata->tokens[0].len = cdata->tokens[1].len = 0;
+		cdata->tokens[2].str = (char *)"HTTP/2.0";
+		cdata->tokens[2].len = 8;
+		cdata->tokenslen     = 3;
+	} else {
+		buf  = scratch;
+		room = sizeof(scratch);
+	}
+
+	p   = in;
+	end = in + len;
+	pos = 0;
+	while (p < end) {
+		/*A dynamic table size update*/
+		if ((*p & 0xe0) == 0x20) {
+			if (!hpack_int(&p, end, 5, &index) || (index > HPACK_TABLE_SIZE))
+				return false;
+			table->max = index;
+			hpack_evict(table, index);
+			continue;
+		}
+
+		/*An indexed field*/
+		if (*p & 0x80) {
+			if (!hpack_int(&p, end, 7, &index) ||
+			    !hpack_entry(table, index, &ename, &namelen, &evalue, &valuelen) ||
+			    ((namelen + valuelen) > (room - pos)))
+				return false;
+
+			name  = buf + pos;
+			value = name + namelen;
+			memcpy(name, ename, namelen);
+			memcpy(value, evalue, valuelen);
+			pos  += namelen + valuelen;
+			if (cdata)
+				hpack_token(cdata, name, namelen, value, valuelen);
+			continue;
+		}
+
+		/*A literal field, added to the table or not, with an indexed name or not*/
+		indexing = *p & 0x40;
+		if (!hpack_int(&p, end, indexing ? 6 : 4, &index))
+			return false;
+
+		name = buf + pos;
+		if (index) {
+			if (!hpack_entry(table, index, &ename, &namelen, &evalue, &valuelen) ||
+			    (namelen > (room - pos)))
+				return false;
+			memcpy(name, ename, namelen);
+		} else if (!hpack_string(&p, end, name, room - pos, &namelen))
+			return false;
+		pos += namelen;
+
+		value = buf + pos;
+		if (!hpack_string(&p, end, value, room - pos, &valuelen))
+			return false;
+		pos += valuelen;
+
+		if (indexing)
+			hpack_insert(table, name, namelen, value, valuelen);
+		if (cdata)
+			hpack_token(cdata, name, namelen, value, valuelen);
+	}
+
+	return true;
+}
+
+/*Writes an integer with an n bit prefix, first holds the bits in front of it*/
+unsigned char *hpack_put_int(unsigned char *p, unsigned char first, int n, size_t value)
+{
+	size_t mask;
+
+	mask = (1 << n) - 1;
+	if (value < mask) {
+		*p++ = first | value;
+		return p;
+	}
+
+	*p++   = first | mask;
+	value -= mask;
+	for (; value >= 128; value >>= 7)
+		*p++ = (value & 127) | 128;
+	*p++ = value;
+
+	return p;
+}
+
+/*Writes a string literal, without Huffman coding*/
+unsigned char *hpack_put_string(unsigned char *p, const char *str, size_t len)
+{
+	p = hpack_put_int(p, 0, 7, len);
+	memcpy(p, str, len);
+	return p + len;
+}
+
+/*Encodes the HTTP/1.1 response header gen_response left in cdata->response
+  as a header block, returns its length or 0 if it doesn't fit in room.
+  Connection fields don't exist in HTTP/2, and the reason phrase is dropped.*/
+size_t hpack_encode(client_data_t *cdata, unsigned char *out, size_t room)
+{
+	unsigned int i;
+	size_t namelen, valuelen;
+	char *line, *end, *colon, *next;
+	unsigned char *p, *last;
+
+	line = cdata->response;
+	end  = cdata->response + cdata->responselen;
+	p    = out;
+	last = out + room;
+	if ((cdata->responselen < 12) || (room < 5))
+		return 0;
+
+	/*:status is in the static table for the common codes*/
+	for (i = 8; i <= 14; i++) {
+		if (!memcmp(line + 9, hpack_static[i].value, 3))
+			break;
+	}
+	if (i <= 14)
+		*p++ = 0x80 | i;
+	else {
+		*p++ = 0x08;
+		p    = hpack_put_string(p, line + 9, 3);
+	}
+
+	for (line = memchr(line, '\n', end - line); line && ((line + 3) < end); line = next) {
+		line++;
+		if (!(next = memchr(line, '\n', end - line)) || !(colon = memchr(line, ':', next - line)))
+			break;
+
+		namelen = colon - line;
+		for (colon++; (*colon == ' ') && (colon < next); colon++);
+		valuelen = (next - colon) - ((next[-1] == '\r') ? 1 : 0);
+
+		if (((namelen == 10) && !strncasecmp(line, "Connection", 10)) ||
+		    ((namelen == 10) && !strncasecmp(line, "Keep-Alive", 10)))
+			continue;
+		if ((size_t)(last - p) < (namelen + valuelen + 8))
+			return 0;
+
+		/*Literal without indexing, with the name from the static table if it is there*/
+		for (i = 15; i < HPACK_STATIC; i++) {
+			if ((strlen(hpack_static[i].name) == namelen) &&
+			    !strncasecmp(hpack_static[i].name, line, namelen))
+				break;
+		}
+		if (i < HPACK_STATIC)
+			p = hpack_put_int(p, 0, 4, i);
+		else {
+			/*Names are lower case in HTTP/2*/
+			*p++ = 0;
+			p    = hpack_put_int(p, 0, 7, namelen);
+			for (i = 0; i < namelen; i++)
+				*p++ = tolower((unsigned char)line[i]);
+		}
+		p = hpack_put_string(p, colon, valuelen);
+	}
+
+	return p - out;
+}
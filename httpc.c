@@ -1,195 +1,355 @@
-#include <stdio.h>
-#include <stdarg.h>
-#include <stdlib.h>
-#include <stdint.h>
-#include <string.h>
-#include <stdbool.h>
-
-#include <assert.h>
-
-#include <errno.h>
-
-/*Is this required?*/
-#include <sys/types.h>
-
-/*posix*/
-#include <unistd.h>
-#include <sys/stat.h>
-#include <fcntl.h>
-#include <strings.h>
-#include <netinet/in.h>
-#include <netinet/tcp.h>
-#include <sys/socket.h>
-#include <arpa/inet.h>
-#include <sys/epoll.h>
-#include <sys/sendfile.h>
-
-#include <netdb.h>
-#include <signal.h>
-
-/*tokens are pretty much required to parse http
-  without large amount of code.*/
-typedef struct {
-	char *str;
-	size_t len;
-}token;
-
-
-typedef struct _client_data_t client_data_t;
-typedef bool (*client_cb_t) (client_data_t *cdata, int efd);
-struct _client_data_t {
-	/*fd in epoll associated with this struct*/
-	int fd;
-
-	/*read and write functions are set here*/
-	client_cb_t cb_func;
-
-	/*tokenized version of the request buffer*/
-	token *tokens;
-	unsigned int tokenslen;
-
-	/*fd of requested file, if one is requested*/
-	int rfd; /*read-only, hence the 'r' in 'rfd'*/
-	/*These variables are information about the file to be read*/
-	size_t tosend;
-	off_t offset;
-	bool readfile;
-
-	char *response;
-	/*This is the amount of data to send, not the actual
-	  length of response, which is headerlen just like it is for request*/
-	unsigned int responselen;
-	unsigned int response_sent;
-
-	char *request;
-	/*Since this would always be headerlen, there isn't a point in setting it.*/
-	/*unsigned int requestlen;*/
-	unsigned int request_recvd;
-
-	/*Set if keepalive is in the http header*/
-	bool keepalive;
-
-	/*Is used in the client context allocation functions*/
-	bool inuse;
-};
-
-/*0.0.0.0 should mean bind to any ipv4 address*/
-const char IPANY[] = "0.0.0.0";
-
-/*cdata->request and cdata->response are of headerlen*/
-const unsigned int headerlen   = 4096;
-/*cdata->tokens is of length maxtokens*/
-const unsigned int maxtokens   = 128;
-
-/*Used in the event loop to stop the program when ctrl+c is used*/
-bool end_program = false;
-
-/*Tracking variables*/
-size_t gcdata_len;
-client_data_t **gcdata;
-
-/*Utility header*/
-#include "utils.h"
+#include "httpc.h"
 
 /*Prototypes*/
 int create_epoll(int lsock);
-bool setnonblocking(int sfd);
+void accept_pause(client_data_t *listener, int efd);
+void accept_resume(int efd);
 bool cb_recv(client_data_t *cdata, int efd);
 bool cb_send(client_data_t *cdata, int efd);
+bool cb_sendfile(client_data_t *cdata, int efd);
 bool cb_accept(client_data_t *cdata, int efd);
+bool would_block(ssize_t ret);
+bool queue_responses(client_data_t *cdata);
+bool response_done(client_data_t *cdata, int efd);
 void close_client(client_data_t *data, int efd);
-int create_sock(const char *address, const char* port, bool client);
+void ready_push(client_data_t *cdata);
+void ready_remove(client_data_t *cdata);
 void event_loop(int efd, int lsock, struct epoll_event *events, int maxevents);
-
+bool cb_wakeup(client_data_t *cdata, int efd);
+void worker_drain(int efd);
+void wake_workers(void);
+void *worker_main(void *arg);
+
+bool grow_cdata(void);
+bool cdata_available(void);
+void cdata_reclaim(void);
 client_data_t *alloc_cdata(void);
 void free_cdata(client_data_t *ptr);
+void alloc_buffers(client_data_t *cdata);
+void free_buffers(client_data_t *cdata);
+bool cb_proxy(client_data_t *cdata, int efd);
+bool cb_upstream(client_data_t *up, int efd);
+bool cb_h2(client_data_t *cdata, int efd);
+
+/*io_uring event loop*/
+#include "uring.h"
+/*Reverse proxy*/
+#include "proxy.h"
+/*HTTP/2*/
+#include "h2.h"
+/*Listening sockets, inherited or handed over on restart*/
+#include "handoff.h"
 
 void end_sig(int param)
 {
 	end_program = true;
 }
 
+void metrics_sig(int param)
+{
+	dump_metrics = true;
+}
+
 /*Code*/
 int main(int argc, char *argv[])
+{
+	int opt;
+	long ncpus;
+	unsigned int i, left;
+	eventfd_t value;
+	sigset_t sigs, oldsigs;
+	struct pollfd handoff, exited;
+
+	/*One worker per online cpu unless told otherwise*/
+	ncpus    = sysconf(_SC_NPROCESSORS_ONLN);
+	nworkers = (ncpus > 0) ? (unsigned int)ncpus : 1;
+
+	while ((opt = getopt(argc, argv, "w:c:s:m:e:r:k:o:b:d:p:u:")) != -1) {
+		switch (opt) {
+		case 'w':
+			nworkers = (unsigned int)strtoul(optarg, NULL, 10);
+			if (!nworkers)
+				die("Worker count must be at least 1\n");
+			break;
+		case 'c':
+			gcdata_cap = strtoul(optarg, NULL, 10);
+			/*The listening socket and the wake up eventfd take a slot each*/
+			if (gcdata_cap < 3)
+				die("Client limit must be at least 3\n");
+			break;
+		case 's':
+			fcache_body_max = strtoul(optarg, NULL, 10);
+			break;
+		case 'm':
+			fcache_body_budget = strtoul(optarg, NULL, 10);
+			break;
+		case 'e':
+			if (!strcmp(optarg, "epoll"))
+				engine = ENGINE_EPOLL;
+			else if (!strcmp(optarg, "uring"))
+				engine = ENGINE_URING;
+			else
+				die("Engine must be epoll or uring\n");
+			break;
+		case 'r':
+			timer_limits[TIMER_HEADER] = (unsigned int)strtoul(optarg, NULL, 10);
+			break;
+		case 'k':
+			timer_limits[TIMER_IDLE] = (unsigned int)strtoul(optarg, NULL, 10);
+			break;
+		case 'o':
+			timer_limits[TIMER_SEND] = (unsigned int)strtoul(optarg, NULL, 10);
+			break;
+		case 'b':
+			listen_backlog = atoi(optarg);
+			if (listen_backlog < 1)
+				die("Backlog must be at least 1\n");
+			break;
+		case 'd':
+			defer_accept = atoi(optarg);
+			break;
+		case 'p':
+			proxy_add(optarg);
+			break;
+		case 'u':
+			handoff_path = optarg;
+			break;
+		default:
+			die("usage: %s [-w workers] [-c max clients per worker] "
+			    "[-s small file size] [-m small file memory] [-e epoll|uring] "
+			    "[-r header timeout] [-k keep-alive timeout] [-o send timeout] "
+			    "[-b listen backlog] [-d defer accept seconds] "
+			    "[-p /prefix/=host:port]... [-u handoff socket]\n", argv[0]);
+		}
+	}
+
+	/*Backend connections are only driven by the epoll engine*/
+	if (proxy_nroutes && (engine == ENGINE_URING)) {
+		fprintf(stderr, "Proxy routes need the epoll engine, using it instead of io_uring\n");
+		engine = ENGINE_EPOLL;
+	}
+
+	/*Picks the widest header scanning kernels the cpu has*/
+	scan_init(NULL);
+	hpack_init();
+
+	/*Takes over the sockets of the httpc being restarted, or of systemd,
+	  before creating new ones*/
+	if (!(handoff_path && handoff_receive(handoff_path)) && !listen_inherit())
+		listen_create();
+	/*Every socket needs a worker accepting on it*/
+	if (nlisten > nworkers) {
+		fprintf(stderr, "Inherited %u listening sockets, starting as many workers\n", nlisten);
+		nworkers = nlisten;
+	}
+
+	signal(SIGINT, end_sig);
+	signal(SIGTERM, end_sig);
+	signal(SIGUSR1, metrics_sig);
+	signal(SIGPIPE, SIG_IGN);
+
+	/*Worker threads inherit the signal mask, so SIGINT, SIGTERM and SIGUSR1 are
+	  blocked while creating them to make sure only the main thread handles them*/
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGINT);
+	sigaddset(&sigs, SIGTERM);
+	sigaddset(&sigs, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &sigs, &oldsigs);
+
+	if ((exitfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+		die("Failed to create exit eventfd\n");
+
+	workers = palloc(sizeof(worker_t), nworkers);
+	metrics = palloc(sizeof(metrics_t), nworkers);
+	for (i = 0; i < nworkers; i++) {
+		hist_init(&metrics[i].latency);
+		workers[i].id     = i;
+		workers[i].lsock  = listen_worker(i);
+		workers[i].wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (workers[i].wakefd < 0)
+			die("Failed to create wake up eventfd\n");
+
+		if (pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]))
+			die("Failed to create worker thread\n");
+	}
+
+	/*Only opened once the workers are accepting, a negative fd is ignored by ppoll*/
+	handoff.fd     = handoff_path ? handoff_listen(handoff_path) : -1;
+	handoff.events = POLLIN;
+
+	/*Sleeps until SIGINT or SIGTERM, dumping the metrics on SIGUSR1,
+	  or until a new process takes the listening sockets over*/
+	while (!end_program) {
+		if ((ppoll(&handoff, 1, NULL, &oldsigs) > 0) && handoff_send(handoff.fd)) {
+			fprintf(stderr, "Listening sockets handed over, draining connections\n");
+			draining = true;
+			break;
+		}
+
+		if (dump_metrics) {
+			dump_metrics = false;
+			metrics_print(stderr);
+		}
+	}
+
+	wake_workers();
+
+	/*Draining workers exit once their connections are done, or time out.
+	  Signals are still taken meanwhile, SIGINT or SIGTERM stops them right away.*/
+	exited.fd     = exitfd;
+	exited.events = POLLIN;
+	for (left = draining ? nworkers : 0; left && !end_program;) {
+		if ((ppoll(&exited, 1, NULL, &oldsigs) > 0) && !eventfd_read(exitfd, &value))
+			left -= (value < left) ? value : left;
+
+		if (dump_metrics) {
+			dump_metrics = false;
+			metrics_print(stderr);
+		}
+	}
+	if (left) {
+		fprintf(stderr, "Stopping without waiting for the rest of the connections\n");
+		wake_workers();
+	}
+
+	for (i = 0; i < nworkers; i++) {
+		pthread_join(workers[i].thread, NULL);
+		close(workers[i].wakefd);
+	}
+	close(exitfd);
+
+	/*The path belongs to the new process after a handoff*/
+	if (handoff.fd >= 0) {
+		close(handoff.fd);
+		if (!draining)
+			unlink(handoff_path);
+	}
+
+	free(listen_fds);
+	free(workers);
+	free(metrics);
+	return 0;
+}
+
+/*Runs one complete server instance, started once per worker thread*/
+void *worker_main(void *arg)
 {
 	int maxevents;
-	unsigned int i;
+	size_t i;
 	/*listen, client sock, and event poll desc*/
 	int lsock,  efd;
+	worker_t *worker;
 	client_data_t *cdata;
+	struct epoll_event event;
 	struct epoll_event *events;
 
+	worker   = arg;
+	wmetrics = &metrics[worker->id];
+
 	/*seems like a good limit to the maximum number of events*/
 	maxevents = 20;
 
-	signal(SIGINT, end_sig);
-	signal(SIGPIPE, SIG_IGN);
-
-	/*Since the listening socket is included in SOMAXCONN,
-	  SOMAXCONN seems like a reasonable limit to the amount of client data structs*/
-	gcdata_len = SOMAXCONN;
-
-	/*Initializing memory*/
-	gcdata = palloc(sizeof(client_data_t*), gcdata_len);
+	/*Initializing memory, the client data pool itself grows on demand*/
+	gcdata = palloc(sizeof(client_data_t*), (gcdata_cap + cdata_chunk - 1) / cdata_chunk);
+	bufs   = palloc(sizeof(char*), (gcdata_cap + bufs_chunk - 1) / bufs_chunk);
 	events = palloc(sizeof(struct epoll_event), maxevents);
 		/*The maximum amount of events is the maximum
 		  amount of clients to be served in one event loop cycle
 		  before the call to epoll_wait is made to check other fd's'*/
 
-	for (i = 0; i < gcdata_len; i++) {
-		cdata           = palloc(sizeof(client_data_t), 1);
-		cdata->tokens   = palloc(sizeof(token)        , maxtokens);
-		cdata->response = palloc(sizeof(char)         , headerlen);
-		cdata->request  = palloc(sizeof(char)         , headerlen);
-		cdata->inuse    = false;
-		gcdata[i]       = cdata;
+	fcache_init();
+	date_tick();
+	timer_init();
+	ready_tail = &ready_head;
+
+	/*Set up by main, see handoff.h*/
+	lsock = worker->lsock;
+
+	efd = -1;
+	if ((engine == ENGINE_URING) && uring_run(lsock, worker->wakefd)) {
+		/*uring_run has closed its connections already*/
+		if (close(lsock))
+			die("lsock\n");
+	} else {
+		if (engine == ENGINE_URING)
+			fprintf(stderr, "worker %u: io_uring unavailable, using epoll\n", worker->id);
+
+		/*Create event poll*/
+		efd = create_epoll(lsock);
+
+		/*The shutdown eventfd is level triggered and never read,
+		  so once it is written epoll_wait keeps returning right away*/
+		cdata          = alloc_cdata();
+		cdata->cb_func = cb_wakeup;
+		cdata->waiting = EPOLLIN;
+		cdata->fd      = worker->wakefd;
+		cdata->rfd     = -1;
+		event.data.ptr = cdata;
+		event.events   = EPOLLIN;
+		if (epoll_ctl(efd, EPOLL_CTL_ADD, worker->wakefd, &event) < 0)
+			die("Failed to add wake up eventfd to epoll.\n");
+
+		/*event loop*/
+		event_loop(efd, lsock, events, maxevents);
 	}
 
-	/*Create listening socket*/
-	lsock = create_sock(IPANY, "8081", false);
-		/*8081 is a good port number, since 8080 is likely to be taken*/
-	if (lsock < 0)
-		die("Failed to create listen socket\n");
+	fprintf(stderr, "worker %u: client pool high-water mark %zu of %zu slots\n",
+		worker->id, gcdata_highwater, gcdata_len);
 
-	/*10 seems like a good backlog*/
-	if (listen(lsock, 10))
-		die("Failed to put socket into listen mode\n");
-
-	/*Create event poll*/
-	efd = create_epoll(lsock);
-
-	/*event loop*/
-	event_loop(efd, lsock, events, maxevents);
+	/*HTTP/2 connections hand back their streams, and the files they were
+	  sending, before the listening socket a stream may resume is closed*/
+	for (i = 0; i < gcdata_len; i++) {
+		cdata = &gcdata[i / cdata_chunk][i % cdata_chunk];
+		if (cdata->inuse && cdata->cb_func && cdata->h2)
+			h2_close(cdata, efd);
+	}
 
 	/*Memory cleanup*/
 	for (i = 0; i < gcdata_len; i++) {/*lsock is cleaned up in this loop*/
-		cdata = gcdata[i];
+		cdata = &gcdata[i / cdata_chunk][i % cdata_chunk];
 
-		if (cdata->inuse) {
-			if (epoll_ctl(efd, EPOLL_CTL_DEL, cdata->fd, NULL) < 0) {
+		/*The eventfd is closed by the main thread, and HTTP/2 streams
+		  share their connection's fd without a callback of their own*/
+		if (cdata->inuse && cdata->fd != worker->wakefd && cdata->cb_func) {
+			/*A paused listener is out of epoll already*/
+			if ((cdata != accept_paused) && (epoll_ctl(efd, EPOLL_CTL_DEL, cdata->fd, NULL) < 0)) {
 				fprintf(stderr, "EPOLL_CTL_DEL in cleanup\n");
 				fflush(stderr);
 			}
 
 			close(cdata->fd);
-			if (cdata->rfd > 0)
-				close(cdata->rfd);
+			if (cdata->file)
+				fcache_release(cdata->file);
 		}
-
-		free(cdata->response);
-		free(cdata->request);
-		free(cdata->tokens);
-		free(cdata);
 	}
 
-	if (close(efd))
+	if ((efd >= 0) && close(efd))
 		die("efd\n");
 
+	fcache_destroy();
+
+	for (i = 0; i < gcdata_len; i += cdata_chunk)
+		free(gcdata[i / cdata_chunk]);
 	free(gcdata);
+	for (i = 0; i < bufs_len; i += bufs_chunk)
+		free(bufs[i / bufs_chunk]);
+	free(bufs);
 	free(events);
-	return 0;
+
+	eventfd_write(exitfd, 1);
+	return NULL;
 }
 
+/*Kicks every worker out of epoll_wait or io_uring_enter, to stop or to start draining*/
+void wake_workers(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < nworkers; i++) {
+		if (eventfd_write(workers[i].wakefd, 1) < 0)
+			die("Failed to wake up worker %u\n", i);
+	}
+}
 
 void event_loop(int efd, int lsock, struct epoll_event *events, int maxevents)
 {
@@ -198,72 +358,187 @@ void event_loop(int efd, int lsock, struct epoll_event *events, int maxevents)
 	client_data_t *cdata;
 	struct epoll_event event;
 
-	while (((nfds = epoll_wait(efd, events, maxevents, -1)) >= 0) && !end_program) {
+	/*Sleeps until an event comes in or the next connection runs out of time,
+	  and only checks for events if there are transfers waiting for their turn*/
+	while (((nfds = epoll_wait(efd, events, maxevents, ready_head ? 0 : timer_timeout())) >= 0) &&
+	       !end_program) {
+		/*Read the clock once for everything this pass does*/
+		date_tick();
+		timer_clock();
+		wmetrics->wakeups++;
+		wmetrics->events += nfds;
+
+		gcdata_batch = true;
 		for (n = 0; n < nfds; n++) {
 			assert(n < maxevents);
 			event = events[n];
 			cdata = event.data.ptr;
 
-			if (!(event.events & (EPOLLERR | EPOLLHUP))) {
+			/*Closed by an earlier event of this pass, the other end of a proxied request*/
+			if (!cdata->inuse)
+				continue;
+
+			/*Backend connections look into errors and hang ups themselves*/
+			if (!(event.events & (EPOLLERR | EPOLLHUP)) || (cdata->waiting & EPOLLERR)) {
+				/*Connections are registered for both directions once,
+				  edges for the one they aren't waiting on are ignored*/
+				if (!(event.events & cdata->waiting))
+					continue;
+
 				assert(cdata->cb_func);
-				cdata->cb_func(cdata, efd);
+				/*Callbacks return true after moving the connection to a
+				  state that can make progress right away*/
+				while (cdata->cb_func(cdata, efd));
 			} else {
 				close_client(cdata, efd);
 			}
 		}
+		gcdata_batch = false;
+		cdata_reclaim();
+		/*The slots closing gave back are the first that can take a client*/
+		if (accept_paused && gcdata_free)
+			accept_resume(efd);
+
+		/*Every transfer that was waiting gets one more turn. The ones that
+		  use up their budget again go to the back, behind the next events.*/
+		for (n = ready_count; n && (cdata = ready_head); n--) {
+			ready_remove(cdata);
+			cdata->waiting = EPOLLOUT;
+			while (cdata->cb_func(cdata, efd));
+		}
+
+		/*Connections that had events this pass have been re-armed already*/
+		while ((cdata = timer_expire())) {
+			wmetrics->timeouts++;
+			close_client(cdata, efd);
+		}
+
+		/*Drained, the wake up eventfd has the last slot*/
+		if (draining && !listen_cdata && (gcdata_inuse == 1))
+			break;
+	}
+}
+
+/*Called on shutdown, event_loop checks end_program right after,
+  or to start draining*/
+bool cb_wakeup(client_data_t *cdata, int efd)
+{
+	eventfd_t value;
+
+	if (draining && !end_program && listen_cdata) {
+		/*Level triggered, it would keep waking the worker up otherwise*/
+		eventfd_read(cdata->fd, &value);
+		worker_drain(efd);
+	}
+
+	return false;
+}
+
+/*Stops accepting once the listening sockets belong to a new process, and
+  closes the connections that are between requests. The others close after
+  their response, HTTP/2 ones after their streams.*/
+void worker_drain(int efd)
+{
+	size_t i;
+	client_data_t *cdata;
+
+	/*The socket stays open in the new process, so it won't leave epoll by itself*/
+	if (accept_paused)
+		accept_paused = NULL;
+	else if (epoll_ctl(efd, EPOLL_CTL_DEL, listen_cdata->fd, NULL) < 0)
+		die("Failed to remove the listening socket\n");
+	close(listen_cdata->fd);
+	free_cdata(listen_cdata);
+	listen_cdata = NULL;
+
+	proxy_drain(efd);
+
+	for (i = 0; i < gcdata_len; i++) {
+		cdata = &gcdata[i / cdata_chunk][i % cdata_chunk];
+		if (!cdata->inuse)
+			continue;
+
+		if (cdata->h2) {
+			h2_drain(cdata, efd);
+			continue;
+		}
+		if ((cdata->cb_func != cb_recv) || cdata->request_recvd)
+			continue;
+
+		/*A request that just came in is still answered*/
+		while (cdata->cb_func(cdata, efd));
+		if (cdata->inuse && (cdata->cb_func == cb_recv) && !cdata->request_recvd)
+			close_client(cdata, efd);
 	}
 }
 
 bool cb_accept(client_data_t *cdata, int efd)
 {
-	int lsock, csock;
-	socklen_t caddrlen;
-	struct sockaddr caddr;
+	int lsock, csock, one;
+	client_data_t *listener;
 	struct epoll_event event;
 
-	lsock = cdata->fd;
+	listener = cdata;
+	lsock    = listener->fd;
+	one      = 1;
 
 	while (true) {
-		caddrlen = sizeof(caddr);
-		csock    = accept(lsock, &caddr, &caddrlen);
+		/*With the pool exhausted, connections are left waiting in the
+		  backlog instead of being accepted only to be closed again*/
+		if (!cdata_available()) {
+			accept_pause(listener, efd);
+			break;
+		}
+
+		/*The socket comes out nonblocking, without the fcntl calls*/
+		csock = accept4(lsock, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
 		if (csock < 0) {
 			/*Means all connections that can be accepted without
 			  blocking have been.*/
 			if (errno == EAGAIN ||
 			    errno == EWOULDBLOCK)
 				break;
-			else {
-				fprintf(stderr, "accept: %d\n", errno);
-				continue;
+			/*Out of descriptors, the same as running out of slots*/
+			if (errno == EMFILE || errno == ENFILE) {
+				accept_pause(listener, efd);
+				break;
 			}
-		}
-
-		if (!setnonblocking(csock)) {
-			if (close(csock))
-				die("Set nonblocking\n");
+			/*The client gave up while it was waiting, or the kernel
+			  is short on memory, the next one may still work out*/
+			if (errno != ECONNABORTED && errno != EINTR)
+				fprintf(stderr, "accept: %d\n", errno);
 			continue;
 		}
 
 		cdata = alloc_cdata();
-		if (!cdata) {
-			close(csock);
-			continue;
-		}
+		wmetrics->accepts++;
+
+		/*Pipelined responses with a body go out one send each, which Nagle
+		  would hold back for the client's delayed ACK. Headers waiting for
+		  their body are held with MSG_MORE instead.*/
+		setsockopt(csock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
 
 		cdata->request_recvd = 0;
 		cdata->rfd           = -1;
+		cdata->file          = NULL;
 		cdata->keepalive     = true; /*Default according to the http/1.1 spec*/
 		cdata->fd            = csock;
+		parse_reset(cdata);
 		cdata->cb_func       = cb_recv;
+		cdata->waiting       = EPOLLIN;
 		event.data.ptr       = cdata;
 		/*What doees edge triggered mean in software?*/
-		event.events         = EPOLLIN | EPOLLET;
+		/*Registered for both directions once, so moving between reading
+		  and writing never needs another epoll_ctl call*/
+		event.events         = EPOLLIN | EPOLLOUT | EPOLLET;
 
 		if (epoll_ctl(efd, EPOLL_CTL_ADD, csock, &event) < 0)
 			die("EPOLL_CTL_ADD\n");
+
+		timer_arm(cdata, TIMER_HEADER);
 	}
 
-	return true;
+	return false;
 }
 
 /*EPOLLIN:  Request for notification that the socket is ready to be read from*/
@@ -271,144 +546,304 @@ bool cb_accept(client_data_t *cdata, int efd)
 /*EPOLLET: As far as I can understand, it means not to wake up epoll_wait until
            there is enough data not to waste a lot of CPU time reading small amounts
            of data each time it trickles in.*/
-/*mod_epoll_event = Modify the events set for a particular file descriptor*/
-void mod_epoll_event(client_data_t *cdata, int efd, int eflags)
-{
-	struct epoll_event event;
+/*With edge triggering every callback keeps going until the syscall returns EAGAIN,
+  and only then sets cdata->waiting and returns false to wait for the next edge.*/
 
-	event.data.ptr = cdata;
-	event.events   = eflags | EPOLLERR | EPOLLHUP;
-	if(epoll_ctl(efd, EPOLL_CTL_MOD, cdata->fd, &event) < 0)
-		die("mod_epoll_event\n");
+/*Returns true if the last syscall would have blocked*/
+bool would_block(ssize_t ret)
+{
+	return (ret < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK));
 }
 
 /*Handles client requests*/
 bool cb_recv(client_data_t *cdata, int efd)
 {
 	ssize_t ret;
-	bool endofheader;
 
-	/*Not really sure what flags can be applied to recv that would be relevant*/
-	/*amount_read = recv(int socket_fd, void *buffer, size_t buffer_length, int flags)*/
-	ret = recv(cdata->fd, cdata->request+cdata->request_recvd, ((headerlen - cdata->request_recvd)-1) , 0);
-	if (ret <= 0) {
-		close_client(cdata, efd);
-		return false;
-	}
-				/*returns NULL if sequence isn't found,
-				 and the pointer to the position if it is.*/
-	endofheader           = strstr(cdata->request, "\r\n\r\n");
-	cdata->request_recvd += (size_t)ret;
+	alloc_buffers(cdata);
 
-	if (!endofheader && (!(cdata->request_recvd - headerlen)))
-		close_client(cdata, efd);
-	else if (endofheader) {
-		/*recv shouldn't read more than (headerlen - cdata->request_recvd)-1*/
-		assert(cdata->request_recvd < headerlen);
-		/*Writes null byte to the end of the request header for tokenizing/parsing purposes*/
-		cdata->request[cdata->request_recvd+1] = '\0'; 
-
-		/*Parses requests, and generates a response*/
-		header_tokenize(cdata);
-		if (!gen_response(cdata)) {
+	while (true) {
+		/*Not really sure what flags can be applied to recv that would be relevant*/
+		/*amount_read = recv(int socket_fd, void *buffer, size_t buffer_length, int flags)*/
+		ret = recv(cdata->fd, cdata->request+cdata->request_recvd, ((headerlen - cdata->request_recvd)-1) , 0);
+		if (would_block(ret)) {
+			wmetrics->eagain_recv++;
+			cdata->waiting = EPOLLIN;
+			/*Idle connections don't hold on to buffers*/
+			if (!cdata->request_recvd)
+				free_buffers(cdata);
+			return false;
+		}
+		if (ret <= 0) {
 			close_client(cdata, efd);
+			return false;
+		}
+		cdata->request_recvd += (size_t)ret;
+		timer_received(cdata);
+
+		/*Only the new bytes are parsed, the parser picks up where it stopped.
+		  Malformed requests are handled by queue_responses.*/
+		if (parse_request(cdata) != PARSE_INCOMPLETE) {
+			/*recv shouldn't read more than (headerlen - cdata->request_recvd)-1*/
+			assert(cdata->request_recvd < headerlen);
+			/*Parses requests, and generates the responses*/
+			if (!queue_responses(cdata)) {
+				close_client(cdata, efd);
+				return false;
+			}
+
+			/*The socket is almost always writable, so the response is
+			  sent right away instead of waiting for EPOLLOUT*/
 			return true;
 		}
 
-		mod_epoll_event(cdata, efd, EPOLLOUT | EPOLLET);
-		cdata->cb_func = cb_send;
-		return true;
+		/*A full buffer without the end of the header can never become a request*/
+		if (cdata->request_recvd >= (headerlen-1)) {
+			close_client(cdata, efd);
+			return false;
+		}
+	}
+}
+
+/*Answers every complete request at the start of the request buffer, pipelined
+  ones included. Their response headers are queued up back to back in the
+  response buffer, so they go out with a single send. Queuing stops after a
+  response with a body, which has to be sent with sendfile first, and before
+  a request for a proxy route, which is answered on its own by cb_proxy,
+  or for HTTP/2, which takes the connection over with h2_start.
+  Sets cdata->cb_func to send what was queued.
+  Returns false if the connection should be closed right away.*/
+bool queue_responses(client_data_t *cdata)
+{
+	int parsed, route;
+	size_t requestlen;
+	bool ret;
+
+	cdata->responselen   = 0;
+	cdata->response_sent = 0;
+	timer_arm(cdata, TIMER_SEND);
+	/*Latency is counted from here to the last byte sent*/
+	cdata->started       = metrics_clock();
+	cdata->batched       = 0;
+	cdata->cb_func       = cb_send;
+
+	while ((parsed = parse_request(cdata)) == PARSE_DONE) {
+		/*HTTP/2 takes over the connection, after the responses in front of it*/
+		if (h2_enabled && (h2_preface_wanted(cdata) || h2_upgrade_wanted(cdata))) {
+			if (cdata->responselen)
+				break;
+			return h2_start(cdata, !h2_preface_wanted(cdata));
+		}
+
+		/*Responses queued in front of it are sent first*/
+		if ((route = proxy_route(cdata)) >= 0) {
+			if (cdata->responselen)
+				break;
+			return proxy_start(cdata, route);
+		}
+
+		requestlen = cdata->parse_pos;
+		ret        = gen_response(cdata);
+		cdata->batched += ret;
+
+		/*Drops the answered request, the next one moves to the front*/
+		cdata->request_recvd -= requestlen;
+		memmove(cdata->request, cdata->request + requestlen, cdata->request_recvd);
+		parse_reset(cdata);
+
+		/*The responses queued so far still get sent before closing*/
+		if (!ret)
+			return cdata->responselen > 0;
+
+		if (cdata->readfile || !cdata->keepalive)
+			break;
+
+		/*Leaves enough room for the largest response header*/
+		if ((headerlen - cdata->responselen) < batch_reserve)
+			break;
+	}
+
+	/*Malformed requests end the connection, once the responses
+	  queued for the requests in front of them have been sent*/
+	if (parsed == PARSE_ERROR) {
+		cdata->keepalive = false;
+		return cdata->responselen > 0;
 	}
 
 	return true;
 }
 
-/*The zero copy method is supposed to be the most efficient way to send data in a user space program.*/
-bool cb_sendfile(client_data_t *cdata, int efd)
+/*Called once a response, body included, has been sent completely*/
+/*Returns true if the connection has something to do right away*/
+bool response_done(client_data_t *cdata, int efd)
 {
-	off_t offset;
-	ssize_t ret;
+	metrics_answered(cdata);
 
-
-	offset = cdata->offset;
-	/*offset gets updated with the current position*/
-	/*amount_read = sendfile(int write_fd, int read_fd, off_t *offset_in_read_fd, size_t amount_left_to_send)*/
-	ret = sendfile(cdata->fd, cdata->rfd, &cdata->offset, cdata->tosend);
-	if (ret <= 0) {
-		fprintf(stderr, "cb_sendfile\n");
+	if (!cdata->keepalive || draining) {
 		close_client(cdata, efd);
 		return false;
 	}
 
-	/*If data isn't sent, will epoll not raise another event because sendfile was at least called?*/
-	assert(offset != cdata->offset);
-	/*It should always be greater than zero, right?*/
-	assert(cdata->offset > 0);
-	/*sendfile shouldn't send more than requested*/
-	assert(((size_t)ret) <= cdata->tosend);
-
-	/*Subtract out what's been sent already*/
-	cdata->tosend -= (size_t)ret;
+	/*The next request may have started coming in already*/
+	timer_arm(cdata, cdata->request_recvd ? TIMER_HEADER : TIMER_IDLE);
 
-	/*Sets flag in client struct when done reading*/
-	if (!cdata->tosend) {
-		if (cdata->keepalive) {
-			cdata->request_recvd = 0;
-			cdata->cb_func       = cb_recv;
-			mod_epoll_event(cdata, efd, EPOLLIN | EPOLLET);
-		} else
+	/*Requests that were pipelined behind the last ones are answered right away*/
+	if (parse_request(cdata) != PARSE_INCOMPLETE) {
+		if (!queue_responses(cdata)) {
 			close_client(cdata, efd);
-	}
+			return false;
+		}
+	} else
+		/*Look for another header, there may already be data
+		  waiting that epoll won't report a second time*/
+		cdata->cb_func = cb_recv;
 
 	return true;
 }
 
-/*Handles the response header to clients*/
-bool cb_send(client_data_t *cdata, int efd)
+/*The zero copy method is supposed to be the most efficient way to send data in a user space program.*/
+bool cb_sendfile(client_data_t *cdata, int efd)
 {
+	off_t offset;
 	ssize_t ret;
+	size_t budget, len;
+
+	/*A client on a fast link could otherwise keep the worker busy for as
+	  long as its file takes to send*/
+	budget = send_budget;
+
+	while (cdata->tosend) {
+		if (!budget) {
+			/*Starts reading the next turn's worth of the file in the
+			  background, so it isn't read from disk on the event loop*/
+			len = (cdata->tosend < send_budget) ? cdata->tosend : send_budget;
+			posix_fadvise(cdata->rfd, cdata->offset, len, POSIX_FADV_WILLNEED);
+
+			/*The socket is most likely still writable, but there won't be
+			  another edge for it, so it waits in the ready queue instead*/
+			cdata->waiting = 0;
+			ready_push(cdata);
+			wmetrics->send_yields++;
+			return false;
+		}
 
-	/*Not really sure what send flags could be applicable here.*/
-	/*amount_sent = send(int socket_fd, void *buffer, size_t buffer_length, int flags)*/
-	ret = send( cdata->fd,                                  \
-		   (cdata->response + cdata->response_sent),    \
-		   (cdata->responselen - cdata->response_sent), \
-		    0);
-	if (ret <= 0) {
-		fprintf(stderr, "cb_send\n");
-		close_client(cdata, efd);
-		return false;
+		offset = cdata->offset;
+		len    = (cdata->tosend < budget) ? cdata->tosend : budget;
+		/*offset gets updated with the current position*/
+		/*amount_read = sendfile(int write_fd, int read_fd, off_t *offset_in_read_fd, size_t amount_left_to_send)*/
+		ret = sendfile(cdata->fd, cdata->rfd, &cdata->offset, len);
+		if (would_block(ret)) {
+			wmetrics->eagain_send++;
+			cdata->waiting = EPOLLOUT;
+			return false;
+		}
+		if (ret <= 0) {
+			fprintf(stderr, "cb_sendfile\n");
+			close_client(cdata, efd);
+			return false;
+		}
+
+		/*If data isn't sent, will epoll not raise another event because sendfile was at least called?*/
+		assert(offset != cdata->offset);
+		/*It should always be greater than zero, right?*/
+		assert(cdata->offset > 0);
+		/*sendfile shouldn't send more than requested*/
+		assert(((size_t)ret) <= cdata->tosend);
+
+		/*Subtract out what's been sent already*/
+		cdata->tosend -= (size_t)ret;
+		budget        -= (size_t)ret;
+		wmetrics->bytes_sendfile += (size_t)ret;
+		timer_arm(cdata, TIMER_SEND);
 	}
-	cdata->response_sent += ret; /*Add up what has been sent*/
 
-	if (cdata->response_sent == cdata->responselen) {
-		if (!cdata->keepalive) {
+	/*Hands the file back to the cache*/
+	fcache_release(cdata->file);
+	cdata->file = NULL;
+	cdata->rfd  = -1;
+
+	return response_done(cdata, efd);
+}
+
+/*Handles the response header to clients, and bodies cached in memory*/
+bool cb_send(client_data_t *cdata, int efd)
+{
+	size_t left;
+	ssize_t ret;
+	struct iovec iov[2];
+
+	while ((cdata->response_sent < cdata->responselen) || (cdata->body && cdata->tosend)) {
+		left = cdata->responselen - cdata->response_sent;
+
+		if (cdata->body) {
+			/*Header and body in a single syscall and, mostly, a single segment*/
+			iov[0].iov_base = cdata->response + cdata->response_sent;
+			iov[0].iov_len  = left;
+			iov[1].iov_base = (char *)cdata->body;
+			iov[1].iov_len  = cdata->tosend;
+			ret = writev(cdata->fd, iov, 2);
+		} else {
+			/*MSG_MORE holds a header that is followed by a body back,
+			  so it leaves in the same segment as the start of the body*/
+			/*amount_sent = send(int socket_fd, void *buffer, size_t buffer_length, int flags)*/
+			ret = send( cdata->fd,                                  \
+				   (cdata->response + cdata->response_sent),    \
+				    left,                                       \
+				    cdata->readfile ? MSG_MORE : 0);
+		}
+		if (would_block(ret)) {
+			wmetrics->eagain_send++;
+			cdata->waiting = EPOLLOUT;
+			return false;
+		}
+		if (ret <= 0) {
+			fprintf(stderr, "cb_send\n");
 			close_client(cdata, efd);
-			return true;
+			return false;
 		}
 
-		if (cdata->readfile) {
-			cdata->offset   = 0;
-			/*cdata->tosend = insert stat here when code is written*/
-			cdata->cb_func  = cb_sendfile;
-			/*I wonder if epoll has to be set every time.
-			  Can it affect performance?*/
-			mod_epoll_event(cdata, efd, EPOLLOUT | EPOLLET);
+		/*Add up what has been sent, the header goes first*/
+		if ((size_t)ret > left) {
+			cdata->response_sent = cdata->responselen;
+			cdata->body         += ret - left;
+			cdata->tosend       -= ret - left;
+			wmetrics->bytes_header += left;
+			wmetrics->bytes_memory += ret - left;
 		} else {
-			/*Look for another header*/
-			cdata->request_recvd = 0;
-			cdata->cb_func       = cb_recv;
-			mod_epoll_event(cdata, efd, EPOLLIN | EPOLLET);
+			cdata->response_sent   += ret;
+			wmetrics->bytes_header += ret;
 		}
+		timer_arm(cdata, TIMER_SEND);
 	}
-	
-	return true;
+
+	if (cdata->body) {
+		/*Hands the file back to the cache*/
+		fcache_release(cdata->file);
+		cdata->file     = NULL;
+		cdata->rfd      = -1;
+		cdata->body     = NULL;
+		cdata->readfile = false;
+
+		return response_done(cdata, efd);
+	}
+
+	if (cdata->readfile) {
+		/*offset and tosend were set by gen_response*/
+		cdata->cb_func = cb_sendfile;
+		return true;
+	}
+
+	return response_done(cdata, efd);
 }
 
 void close_client(client_data_t *cdata, int efd)
 {
 	int errval;
 
+	/*Takes the other end of a proxied request, or HTTP/2 streams, down with it*/
+	proxy_close(cdata, efd);
+	h2_close(cdata, efd);
+
 	errval = 0;
 	/*the event struct must be NULL when deleting fd's from the fd buffer stored in the kernel.*/
 	/*error_status = epoll_ctl(int epoll_fd, int operation_to_perform, int fd_being_watched, struct epoll_event *event)*/
@@ -423,83 +858,76 @@ void close_client(client_data_t *cdata, int efd)
 		if (close(cdata->fd))
 			die("Failed to close fd\n");
 	}
-	/*if a file was being sent, this closes the connection*/
-	if (cdata->rfd >= 0)
-		if (close(cdata->rfd))
-			die("close_client: rfd\n");
+	/*if a file was being sent, this hands it back to the cache*/
+	if (cdata->file) {
+		fcache_release(cdata->file);
+		cdata->file = NULL;
+	}
+	cdata->rfd = -1;
+	if (cdata->pipefd[0] >= 0) {
+		close(cdata->pipefd[0]);
+		close(cdata->pipefd[1]);
+		cdata->pipefd[0] = cdata->pipefd[1] = -1;
+	}
+	timer_cancel(cdata);
+	ready_remove(cdata);
+	free_buffers(cdata);
 	free_cdata(cdata);
+
+	/*There is room for another client now*/
+	if (accept_paused)
+		accept_resume(efd);
 }
 
-/*Returns true, if the file descriptor is
-  set to nonblocking false otherwise.*/
-bool setnonblocking(int fd)
+/*Puts a connection at the back of the ready queue*/
+void ready_push(client_data_t *cdata)
 {
-	int flags;
-
-	/*Gets file descriptor flags*/
-	flags = fcntl(fd, F_GETFL);
-	if (flags < 0)
-		return false;
-
-	/*Sets nonblocking without clobbering the flags already set on the file descriptor*/
-	if (fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
-		return false;
-
-	return true;
+	cdata->rnext = NULL;
+	cdata->rprev = ready_tail;
+	*ready_tail  = cdata;
+	ready_tail   = &cdata->rnext;
+	ready_count++;
 }
 
-/*returns the open socket, -1 on error*/
-/*Make address NULL for a wildcard address*/
-int create_sock(const char *address, const char *port, bool client)
+/*Takes a connection off the ready queue, if it is on it*/
+void ready_remove(client_data_t *cdata)
 {
-	int sock;
-	struct addrinfo hints, *results, *result;
-
-	bzero(&hints, sizeof(struct addrinfo));
-	/*Allows either IPv4 or IPv6*/
-	hints.ai_family     = AF_UNSPEC;
-	/*I'm not exactly sure what this controls,
-	  since socktype and protocol family is set*/
-	hints.ai_protocol   = 0;
-	/*I wonder what this has to do with anything*/
-	hints.ai_socktype   = SOCK_STREAM;
-	/*AI_PASSIVE is the wildcard flag*/
-	hints.ai_flags      = (address) ? 0 : AI_PASSIVE;
-	/*Since these pointers are not in use, they need to be cleared*/
-	hints.ai_canonname  = NULL; /*I wonder what this is for*/
-	hints.ai_addr       = NULL; /*current address*/
-	hints.ai_next       = NULL; /*Net address in line*/
-
-	/*Error on non-zero return*/
-	if (getaddrinfo(address, port, &hints, &results))
-		return -1;
-
-	/*Tries every result recursively*/
-	for (result = results; result != NULL; result = result->ai_next) {
-		sock = socket(result->ai_family,
-			      result->ai_socktype | SOCK_NONBLOCK,
-			      result->ai_protocol);
-		if (sock < 0)
-			continue;
+	if (!cdata->rprev)
+		return;
+
+	*cdata->rprev = cdata->rnext;
+	if (cdata->rnext)
+		cdata->rnext->rprev = cdata->rprev;
+	else
+		ready_tail = cdata->rprev;
+
+	cdata->rnext = NULL;
+	cdata->rprev = NULL;
+	ready_count--;
+}
 
-		/*breaks on success*/
-		if (client) {
-			if (connect(sock, result->ai_addr, result->ai_addrlen) <= 0)
-				break;
-		} else {
-			if (bind(sock, result->ai_addr, result->ai_addrlen) <= 0)
-				break;
-		}
+/*Takes the listener out of epoll until a client is closed*/
+void accept_pause(client_data_t *listener, int efd)
+{
+	if (epoll_ctl(efd, EPOLL_CTL_DEL, listener->fd, NULL) < 0)
+		die("Failed to pause the listening socket\n");
 
-		close(sock);
-	}
+	accept_paused = listener;
+	wmetrics->accept_pauses++;
+}
 
-	freeaddrinfo(results);
+/*Puts the listener back, adding it reports the connections that
+  came in while it was paused right away*/
+void accept_resume(int efd)
+{
+	struct epoll_event event;
 
-	if ((!result) || (sock < 0))
-		return -1;
+	event.data.ptr = accept_paused;
+	event.events   = listen_events;
+	if (epoll_ctl(efd, EPOLL_CTL_ADD, accept_paused->fd, &event) < 0)
+		die("Failed to resume the listening socket\n");
 
-	return sock;
+	accept_paused = NULL;
 }
 
 /*Do epoll file descriptors have to be closed?*/
@@ -516,32 +944,74 @@ int create_epoll(int lsock)
 
 	/*Gets a data structure for the listening socket and adds to epoll*/
 	data           = alloc_cdata();
+	listen_cdata   = data;
 	data->cb_func  = cb_accept;
+	data->waiting  = EPOLLIN;
 	data->fd       = lsock;
 	event.data.ptr = data;
-	event.events   = EPOLLIN | EPOLLET | EPOLLERR | EPOLLHUP;
+	event.events   = listen_events;
 	if (epoll_ctl(efd, EPOLL_CTL_ADD, lsock, &event) < 0)
 		die("Failed to add listening socket to epoll.\n");
 
 	return efd;
 }
 
-/*This essentially pulls the first data structure that is free for use by a connection client*/
+/*Adds another chunk of client data structs to the free list,
+  returns false once gcdata_cap has been reached*/
+bool grow_cdata(void)
+{
+	size_t i, n;
+	client_data_t *chunk, *cdata;
+
+	if (gcdata_len >= gcdata_cap)
+		return false;
+
+	/*The last chunk is cut short so gcdata_cap is never exceeded*/
+	n     = gcdata_cap - gcdata_len;
+	n     = (n < cdata_chunk) ? n : cdata_chunk;
+	chunk = palloc(sizeof(client_data_t), cdata_chunk);
+
+	/*Pushed in reverse so the lowest slot is handed out first*/
+	for (i = n; i > 0; i--) {
+		cdata            = &chunk[i-1];
+		cdata->inuse     = false;
+		cdata->pipefd[0] = cdata->pipefd[1] = -1;
+		cdata->next_free = gcdata_free;
+		gcdata_free      = cdata;
+	}
+
+	gcdata[gcdata_len / cdata_chunk] = chunk;
+	gcdata_len += n;
+	metrics_pool();
+
+	return true;
+}
+
+/*Returns true if alloc_cdata will succeed*/
+bool cdata_available(void)
+{
+	return gcdata_free || grow_cdata();
+}
+
+/*Pops a client data structure off the free list, growing the pool if it is empty*/
 client_data_t *alloc_cdata(void)
 {
-	size_t i;
 	client_data_t *ret;
 
-	for (i = 0; i < gcdata_len; i++) {
-		ret = gcdata[i];
+	if (!gcdata_free && !grow_cdata())
+		return NULL;
 
-		if (!ret->inuse) {
-			ret->inuse = true;
-			return ret;
-		}
-	}
+	ret              = gcdata_free;
+	gcdata_free      = ret->next_free;
+	ret->next_free   = NULL;
+	ret->inuse       = true;
 
-	return NULL;
+	gcdata_inuse++;
+	if (gcdata_inuse > gcdata_highwater)
+		gcdata_highwater = gcdata_inuse;
+	metrics_pool();
+
+	return ret;
 }
 
 /*This makes the client data structure available for reuse*/
@@ -550,10 +1020,89 @@ void free_cdata(client_data_t *p)
 	if (!p->inuse)
 		die("free_cdata\n");
 	p->inuse = false;
+	if (gcdata_batch) {
+		p->next_free = gcdata_dead;
+		gcdata_dead  = p;
+	} else {
+		p->next_free = gcdata_free;
+		gcdata_free  = p;
+	}
+	gcdata_inuse--;
+	metrics_pool();
+}
+
+/*Puts the slots freed during the last batch of events back on the free list*/
+void cdata_reclaim(void)
+{
+	client_data_t *p;
+
+	while ((p = gcdata_dead)) {
+		gcdata_dead  = p->next_free;
+		p->next_free = gcdata_free;
+		gcdata_free  = p;
+	}
 }
 
+/*Adds another chunk of buffer sets to the free list. There is never
+  more than one set per client slot, so bufs has room for every chunk.*/
+void grow_buffers(void)
+{
+	size_t i, setlen;
+	char *chunk, *set;
+
+	setlen = sizeof(token) * maxtokens + 2 * headerlen;
+	chunk  = palloc(setlen, bufs_chunk);
+
+	for (i = bufs_chunk; i > 0; i--) {
+		set           = chunk + (i-1) * setlen;
+		*(char **)set = bufs_free;
+		bufs_free     = set;
+	}
+
+	bufs[bufs_len / bufs_chunk] = chunk;
+	bufs_len += bufs_chunk;
+	metrics_pool();
+}
 
+/*Lends a connection its tokens, request and response buffers, if it doesn't
+  have them already. They are only needed while a request is received or
+  answered, so idle connections are little more than their client_data_t.*/
+void alloc_buffers(client_data_t *cdata)
+{
+	char *set;
 
+	if (cdata->request)
+		return;
 
+	if (!bufs_free)
+		grow_buffers();
 
+	set       = bufs_free;
+	bufs_free = *(char **)set;
+	bufs_inuse++;
 
+	cdata->tokens   = (token *)set;
+	cdata->request  = set + sizeof(token) * maxtokens;
+	cdata->response = cdata->request + headerlen;
+	/*Only the count that changed, this runs on every request*/
+	wmetrics->bufs_inuse = bufs_inuse;
+}
+
+/*Gives the buffers back, once nothing in them is needed anymore*/
+void free_buffers(client_data_t *cdata)
+{
+	char *set;
+
+	if (!cdata->request)
+		return;
+
+	set           = (char *)cdata->tokens;
+	*(char **)set = bufs_free;
+	bufs_free     = set;
+	bufs_inuse--;
+
+	cdata->tokens   = NULL;
+	cdata->request  = NULL;
+	cdata->response = NULL;
+	wmetrics->bufs_inuse = bufs_inuse;
+}
@@ -0,0 +1,266 @@
+/*Types, settings and modules shared by httpc and the tools built from its code*/
+#ifndef HTTPC_H
+#define HTTPC_H
+
+/*Required for SO_REUSEPORT, accept4, and other linux extensions*/
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <ctype.h>
+
+#include <assert.h>
+
+#include <errno.h>
+
+/*Is this required?*/
+#include <sys/types.h>
+
+/*posix*/
+#include <unistd.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <strings.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <time.h>
+
+#include <netdb.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <sys/resource.h>
+
+/*tokens are pretty much required to parse http
+  without large amount of code.*/
+typedef struct {
+	char *str;
+	size_t len;
+}token;
+
+
+typedef struct _fcache_entry_t fcache_entry_t;
+typedef struct _h2_conn_t h2_conn_t;
+typedef struct _client_data_t client_data_t;
+typedef bool (*client_cb_t) (client_data_t *cdata, int efd);
+struct _client_data_t {
+	/*fd in epoll associated with this struct*/
+	int fd;
+	/*fd of requested file, if one is requested*/
+	int rfd; /*read-only, hence the 'r' in 'rfd'*/
+
+	/*read and write functions are set here*/
+	client_cb_t cb_func;
+
+	/*Spans of the request line and header fields, see request.h.
+	  tokens, request and response are borrowed from the worker's buffer
+	  pool while a request is received or answered, and NULL otherwise.*/
+	token *tokens;
+	unsigned int tokenslen;
+	/*Incremental parser state: the next byte to look at,
+	  and where the current token starts*/
+	unsigned char parse_state;
+	unsigned int parse_pos;
+	unsigned int parse_mark;
+
+	/*Cache entry rfd is borrowed from, held until the file is sent*/
+	fcache_entry_t *file;
+	/*These variables are information about the file to be read*/
+	size_t tosend;
+	off_t offset;
+	/*Points into the cached body instead when the file is small enough, and
+	  moves along with offset, the body goes out with writev instead of sendfile*/
+	const char *body;
+
+	char *response;
+	/*This is the amount of data to send, not the actual
+	  length of response, which is headerlen just like it is for request*/
+	unsigned int responselen;
+	unsigned int response_sent;
+
+	char *request;
+	/*Since this would always be headerlen, there isn't a point in setting it.*/
+	/*unsigned int requestlen;*/
+	unsigned int request_recvd;
+
+	/*The response buffer can hold the headers of several pipelined
+	  requests, readfile, rfd, offset and tosend belong to the last one*/
+
+	/*EPOLLIN or EPOLLOUT, whichever the connection is blocked on*/
+	uint32_t waiting;
+
+	/*Timing wheel links and deadline in ticks, see timer.h*/
+	client_data_t *tnext;
+	client_data_t **tprev;
+	uint64_t tdeadline;
+
+	/*Ready queue links, while the connection waits for another turn at sending*/
+	client_data_t *rnext;
+	client_data_t **rprev;
+
+	/*The other end of a proxied request, the backend connection of a client
+	  or the client of a backend connection, see proxy.h*/
+	client_data_t *peer;
+	/*HTTP/2 state of a connection that switched to it, see h2.h*/
+	h2_conn_t *h2;
+
+	/*When the requests being answered were received, and how many there are*/
+	uint64_t started;
+	unsigned int batched;
+
+	/*Pipe bodies are spliced through by the io_uring engine and the proxy,
+	  created on the first body sent and -1 until then, and what is in it*/
+	int pipefd[2];
+	size_t pipelen;
+
+	/*Only used by the io_uring engine*/
+	/*Operations submitted and not completed yet, the struct is freed on the last one*/
+	unsigned int inflight;
+	size_t splicelen;
+	/*Received buffers waiting to be copied into the request buffer*/
+	unsigned short held_head, held_tail, held_off, held;
+	bool recv_armed;
+	bool starved;
+	bool eof;
+	bool closing;
+
+	/*The small fields are kept together at the end, where they pack*/
+	/*Set if a file body is being sent, rfd, offset and tosend are about it*/
+	bool readfile;
+	/*Set if keepalive is in the http header*/
+	bool keepalive;
+	/*Kind of timeout armed, see timer.h*/
+	unsigned char tkind;
+	/*Proxy state, body framing, chunk state and route, see proxy.h, and
+	  whether the backend connection came from the pool or can go back to it*/
+	unsigned char pstate, pframe, pchunk, proute;
+	bool preused;
+	/*Is used in the client context allocation functions*/
+	bool inuse;
+	/*Next free slot while this one sits on the free list*/
+	client_data_t *next_free;
+};
+
+/*0.0.0.0 should mean bind to any ipv4 address*/
+const char IPANY[] = "0.0.0.0";
+
+/*cdata->request and cdata->response are of headerlen*/
+const unsigned int headerlen   = 4096;
+/*cdata->tokens is of length maxtokens*/
+const unsigned int maxtokens   = 128;
+/*The buffer pool grows this many sets of tokens, request and response at a time*/
+const unsigned int bufs_chunk  = 32;
+/*Pipelined responses are only queued while this much of cdata->response is free*/
+const unsigned int batch_reserve = 1024;
+/*Most file body a connection sends per turn, before the others get theirs*/
+const size_t send_budget = 262144;
+/*The client data pool grows this many slots at a time*/
+const unsigned int cdata_chunk = 256;
+
+/*Used in the event loop to stop the program on SIGINT or SIGTERM*/
+volatile bool end_program = false;
+/*Set once the listening sockets have been handed to a new process, workers
+  stop accepting and exit after their last connection, see handoff.h*/
+volatile bool draining = false;
+/*Written to by every worker as it exits, the main thread waits on it while
+  they drain so it can still stop them on a signal*/
+int exitfd = -1;
+
+/*Every worker thread owns its own listening socket, epoll instance and
+  client data pool, so nothing on the hot path is shared between them.*/
+typedef struct {
+	pthread_t thread;
+	unsigned int id;
+	/*Created or inherited by the main thread, the worker closes it*/
+	int lsock;
+	/*Written to by the main thread to wake the worker up on shutdown*/
+	int wakefd;
+}worker_t;
+
+/*Number of worker threads, defaults to the number of online cpus*/
+unsigned int nworkers;
+worker_t *workers;
+
+/*Event loop every worker runs, set with -e*/
+enum {ENGINE_EPOLL, ENGINE_URING} engine = ENGINE_EPOLL;
+/*False on workers that can't switch connections to HTTP/2, the io_uring ones*/
+__thread bool h2_enabled = true;
+
+/*Maximum amount of client data structs per worker*/
+size_t gcdata_cap = 65536;
+
+/*Length of the queue of connections waiting to be accepted, set with -b.
+  The kernel caps it at net.core.somaxconn.*/
+int listen_backlog = 4096;
+/*Seconds the kernel holds on to a connection until its request starts
+  coming in, before handing it to accept anyway, set with -d, 0 turns it off*/
+int defer_accept = 0;
+/*Events the listening socket is registered for. Workers sharing one listening
+  socket would all be woken up for every connection without EPOLLEXCLUSIVE.*/
+const uint32_t listen_events = EPOLLIN | EPOLLET | EPOLLEXCLUSIVE;
+
+/*Tracking variables, one set per worker thread*/
+/*gcdata holds the chunks of cdata_chunk client structs allocated so far,
+  gcdata_len is the total amount of slots in them*/
+__thread size_t gcdata_len;
+__thread client_data_t **gcdata;
+/*Head of the intrusive free list*/
+__thread client_data_t *gcdata_free;
+/*Slots freed while event_loop works through a batch of events wait on
+  gcdata_dead until it is done, so a later event of the same batch for a
+  connection that was closed never reaches one accepted into its slot*/
+__thread bool gcdata_batch;
+__thread client_data_t *gcdata_dead;
+/*Slots in use right now, and the most that have ever been in use*/
+__thread size_t gcdata_inuse;
+__thread size_t gcdata_highwater;
+/*Buffer pool: bufs holds the chunks of bufs_chunk buffer sets allocated
+  so far, bufs_len is the total amount of sets in them, and bufs_free is the
+  head of the free list kept in the first bytes of each free set*/
+__thread char **bufs;
+__thread size_t bufs_len;
+__thread char *bufs_free;
+__thread size_t bufs_inuse;
+/*Connections that used up their send budget with more left to send, oldest
+  first. The tail points at the last rnext, or at ready_head if it is empty.*/
+__thread client_data_t *ready_head;
+__thread client_data_t **ready_tail;
+__thread size_t ready_count;
+/*The listener, while it is out of epoll because no more clients fit*/
+__thread client_data_t *accept_paused;
+/*The listener's slot, NULL once the worker has started draining*/
+__thread client_data_t *listen_cdata;
+
+/*Utility header*/
+#include "utils.h"
+/*Http date formatting and parsing*/
+#include "date.h"
+/*Open file and stat cache*/
+#include "fcache.h"
+/*Latency histograms*/
+#include "hist.h"
+/*Per worker counters, the metrics page and SIGUSR1 dumps*/
+#include "metrics.h"
+/*Connection timeouts*/
+#include "timer.h"
+/*Vectorized byte scanning for the parser*/
+#include "scan.h"
+/*Request parsing*/
+#include "request.h"
+/*HTTP/2 header compression*/
+#include "hpack.h"
+/*Response generation*/
+#include "response.h"
+
+#endif
@@ -0,0 +1,257 @@
+/*Live metrics: counters and a request latency histogram per worker.
+  A worker only ever writes its own, with plain increments and no locks, and
+  the main thread and the metrics page read all of them with relaxed loads,
+  so a dump may be a few requests behind but never slows a worker down.*/
+/*Dumped to stderr on SIGUSR1, and served to local clients at metrics_path,
+  as one line of space separated key=value pairs per worker and one for all.*/
+
+/*Reserved request path of the metrics page*/
+const char metrics_path[] = "/.httpc/metrics";
+
+/*Counters are all 64 bit so a snapshot can be read a word at a time*/
+typedef struct {
+	uint64_t accepts;
+	/*Times accepting stopped because the client pool or the descriptors ran out*/
+	uint64_t accept_pauses;
+	/*Connections closed by one of the timeouts in timer.h*/
+	uint64_t timeouts;
+	/*Responses by the first digit of their status*/
+	uint64_t status[6];
+	/*Bytes sent as response headers, as bodies cached in memory,
+	  and as bodies moved by sendfile or splice*/
+	uint64_t bytes_header;
+	uint64_t bytes_memory;
+	uint64_t bytes_sendfile;
+	/*Bytes of proxied response bodies spliced from a backend, see proxy.h*/
+	uint64_t bytes_proxy;
+	/*Client pool, as kept by alloc_cdata and free_cdata*/
+	uint64_t pool_inuse;
+	uint64_t pool_highwater;
+	uint64_t pool_slots;
+	/*Buffer sets lent to connections, and allocated*/
+	uint64_t bufs_inuse;
+	uint64_t bufs_slots;
+	/*Syscalls that would have blocked, the epoll engine only*/
+	uint64_t eagain_recv;
+	uint64_t eagain_send;
+	/*Times a file body used up its send budget and went to the back of the ready queue*/
+	uint64_t send_yields;
+	/*Connections switched to HTTP/2, and the streams they answered*/
+	uint64_t h2_conns;
+	uint64_t h2_streams;
+	/*Returns from epoll_wait or io_uring_enter, and the events they brought*/
+	uint64_t wakeups;
+	uint64_t events;
+	/*Nanoseconds from a request being received completely to the last
+	  byte of its response being sent*/
+	hist_t latency;
+}metrics_t;
+
+/*One per worker, allocated by main*/
+metrics_t *metrics;
+/*Set from the SIGUSR1 handler, main dumps the metrics when it wakes up*/
+volatile bool dump_metrics = false;
+
+/*The calling worker's metrics. Tools that run the server code outside of a
+  worker count into metrics_unused instead.*/
+metrics_t metrics_unused;
+__thread metrics_t *wmetrics = &metrics_unused;
+/*False on workers whose cdata->fd aren't real descriptors,
+  which can't tell if a client is local*/
+__thread bool metrics_peers = true;
+
+/*Returns the time in nanoseconds, for latencies*/
+uint64_t metrics_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/*Counts a response by its status code, digit is the first digit as a character*/
+void metrics_status(char digit)
+{
+	if ((digit >= '1') && (digit <= '5'))
+		wmetrics->status[digit - '0']++;
+}
+
+/*Records the latency of the requests answered by the response just sent*/
+void metrics_answered(client_data_t *cdata)
+{
+	if (!cdata->batched)
+		return;
+
+	hist_record_n(&wmetrics->latency, metrics_clock() - cdata->started, cdata->batched);
+	cdata->batched = 0;
+}
+
+/*Client and buffer pool occupancy, after they change*/
+void metrics_pool(void)
+{
+	wmetrics->pool_inuse     = gcdata_inuse;
+	wmetrics->pool_highwater = gcdata_highwater;
+	wmetrics->pool_slots     = gcdata_len;
+	wmetrics->bufs_inuse     = bufs_inuse;
+	wmetrics->bufs_slots     = bufs_len;
+}
+
+/*Copies another worker's metrics, a word at a time*/
+void metrics_snapshot(metrics_t *dst, metrics_t *src)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof(metrics_t) / sizeof(uint64_t); i++)
+		((uint64_t *)dst)[i] = __atomic_load_n(&((uint64_t *)src)[i], __ATOMIC_RELAXED);
+}
+
+void metrics_line(FILE *out, const char *worker, metrics_t *m)
+{
+	int i;
+	uint64_t requests;
+
+	for (i = 0, requests = 0; i < 6; i++)
+		requests += m->status[i];
+
+	fprintf(out, "worker=%s accepts=%llu accept_pauses=%llu timeouts=%llu requests=%llu status_1xx=%llu status_2xx=%llu "
+		"status_3xx=%llu status_4xx=%llu status_5xx=%llu bytes_header=%llu "
+		"bytes_memory=%llu bytes_sendfile=%llu bytes_proxy=%llu pool_inuse=%llu pool_highwater=%llu "
+		"pool_slots=%llu bufs_inuse=%llu bufs_slots=%llu eagain_recv=%llu eagain_send=%llu send_yields=%llu h2_conns=%llu h2_streams=%llu wakeups=%llu events=%llu "
+		"events_per_wakeup=%.2f p50_us=%.1f p90_us=%.1f p99_us=%.1f p999_us=%.1f "
+		"max_us=%.1f\n",
+		worker, (unsigned long long)m->accepts, (unsigned long long)m->accept_pauses,
+		(unsigned long long)m->timeouts,
+		(unsigned long long)requests,
+		(unsigned long long)m->status[1], (unsigned long long)m->status[2],
+		(unsigned long long)m->status[3], (unsigned long long)m->status[4],
+		(unsigned long long)m->status[5], (unsigned long long)m->bytes_header,
+		(unsigned long long)m->bytes_memory, (unsigned long long)m->bytes_sendfile,
+		(unsigned long long)m->bytes_proxy,
+		(unsigned long long)m->pool_inuse, (unsigned long long)m->pool_highwater,
+		(unsigned long long)m->pool_slots, (unsigned long long)m->bufs_inuse,
+		(unsigned long long)m->bufs_slots, (unsigned long long)m->eagain_recv,
+		(unsigned long long)m->eagain_send, (unsigned long long)m->send_yields,
+		(unsigned long long)m->h2_conns, (unsigned long long)m->h2_streams,
+		(unsigned long long)m->wakeups,
+		(unsigned long long)m->events,
+		m->wakeups ? (double)m->events / m->wakeups : 0.0,
+		hist_percentile(&m->latency, 50.0) / 1e3,
+		hist_percentile(&m->latency, 90.0) / 1e3,
+		hist_percentile(&m->latency, 99.0) / 1e3,
+		hist_percentile(&m->latency, 99.9) / 1e3,
+		m->latency.max / 1e3);
+}
+
+/*Prints every worker's metrics, and their sum*/
+void metrics_print(FILE *out)
+{
+	int i;
+	unsigned int w;
+	char name[16];
+	metrics_t *snap, *all;
+
+	snap = palloc(sizeof(metrics_t), 1);
+	all  = palloc(sizeof(metrics_t), 1);
+	hist_init(&all->latency);
+
+	for (w = 0; w < nworkers; w++) {
+		metrics_snapshot(snap, &metrics[w]);
+		snprintf(name, sizeof(name), "%u", w);
+		metrics_line(out, name, snap);
+
+		all->accepts        += snap->accepts;
+		all->accept_pauses  += snap->accept_pauses;
+		all->timeouts       += snap->timeouts;
+		for (i = 0; i < 6; i++)
+			all->status[i] += snap->status[i];
+		all->bytes_header   += snap->bytes_header;
+		all->bytes_memory   += snap->bytes_memory;
+		all->bytes_sendfile += snap->bytes_sendfile;
+		all->bytes_proxy    += snap->bytes_proxy;
+		all->pool_inuse     += snap->pool_inuse;
+		all->pool_highwater += snap->pool_highwater;
+		all->pool_slots     += snap->pool_slots;
+		all->bufs_inuse     += snap->bufs_inuse;
+		all->bufs_slots     += snap->bufs_slots;
+		all->eagain_recv    += snap->eagain_recv;
+		all->eagain_send    += snap->eagain_send;
+		all->send_yields    += snap->send_yields;
+		all->h2_conns       += snap->h2_conns;
+		all->h2_streams     += snap->h2_streams;
+		all->wakeups        += snap->wakeups;
+		all->events         += snap->events;
+		hist_merge(&all->latency, &snap->latency);
+	}
+	metrics_line(out, "all", all);
+
+	free(snap);
+	free(all);
+}
+
+/*Returns true if the client on the other end of fd is on this machine*/
+bool metrics_local(int fd)
+{
+	socklen_t len;
+	struct sockaddr_storage addr;
+	struct sockaddr_in6 *addr6;
+
+	if (!metrics_peers)
+		return false;
+
+	len = sizeof(addr);
+	if (getpeername(fd, (struct sockaddr *)&addr, &len) < 0)
+		return false;
+
+	if (addr.ss_family == AF_INET)
+		return (ntohl(((struct sockaddr_in *)&addr)->sin_addr.s_addr) >> 24) == 127;
+
+	if (addr.ss_family == AF_INET6) {
+		addr6 = (struct sockaddr_in6 *)&addr;
+		return IN6_IS_ADDR_LOOPBACK(&addr6->sin6_addr) ||
+		       (IN6_IS_ADDR_V4MAPPED(&addr6->sin6_addr) && (addr6->sin6_addr.s6_addr[12] == 127));
+	}
+
+	return false;
+}
+
+/*Renders the metrics page into an entry of its own, which isn't in the cache.
+  It is referenced once and stale already, so it is sent like any body
+  cached in memory and freed by the release after the send.*/
+fcache_entry_t *metrics_entry(void)
+{
+	FILE *out;
+	char *text, *name;
+	size_t len;
+	struct stat st;
+	fcache_entry_t *entry;
+
+	text = NULL;
+	len  = 0;
+	if (!(out = open_memstream(&text, &len)))
+		return NULL;
+	metrics_print(out);
+	if (fclose(out)) {
+		free(text);
+		return NULL;
+	}
+
+	/*Changes every time, so the ETag and Last-Modified never match a stale copy*/
+	memset(&st, 0, sizeof(st));
+	st.st_mode = S_IFREG | 0444;
+	st.st_size = len;
+	clock_gettime(CLOCK_REALTIME, &st.st_mtim);
+
+	name = palloc(sizeof(char), sizeof(metrics_path));
+	memcpy(name, metrics_path, sizeof(metrics_path));
+
+	entry        = fcache_new(name, sizeof(metrics_path) - 1, 0, -1, &st, date_now);
+	entry->refs  = 1;
+	entry->stale = true;
+	if (len) {
+		entry->body        = text;
+		fcache_body_bytes += len;
+	} else
+		free(text);
+
+	return entry;
+}
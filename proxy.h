@@ -0,0 +1,781 @@
+/*Reverse proxy: requests for paths under a route's prefix are forwarded to
+  its backend, over keep-alive connections kept in a pool per worker and route.
+  Response bodies are moved from the backend socket to the client socket with
+  splice, through a pipe per client connection, so they never enter user space.*/
+/*Only GET and HEAD are forwarded, with the header fields they came with except
+  for the hop-by-hop Connection and Keep-Alive, which are dropped from responses
+  as well. Bodies with a Content-Length are spliced as they are, chunked ones are
+  spliced a chunk at a time with only the chunk sizes read in between, and ones
+  without either last until the backend closes, which closes the client too.
+  Backend connections get their own client_data_t, with cb_upstream as their
+  callback and peer pointing at the client they are answering, if any.
+  Needs the epoll engine.*/
+
+#define PROXY_MAX_ROUTES 16
+
+/*Idle backend connections kept per route and worker, the rest are closed*/
+const unsigned int proxy_maxidle = 32;
+/*Longest chunk size or trailer line of a chunked response*/
+const size_t proxy_maxline = 1024;
+/*Most body spliced into the pipe at a time, what a default pipe holds*/
+const size_t proxy_chunk = 65536;
+
+/*Set with -p prefix=host:port, prefixes are tried in the order given*/
+typedef struct {
+	char *prefix;
+	size_t prefixlen;
+	/*The backend's addresses, resolved once at startup so a slow resolver
+	  never holds up an event loop*/
+	struct addrinfo *addrs;
+}proxy_route_t;
+
+proxy_route_t proxy_routes[PROXY_MAX_ROUTES];
+unsigned int proxy_nroutes;
+
+/*Idle backend connections of every route, most recently used first,
+  linked through rnext and rprev since they are never on the ready queue*/
+__thread client_data_t *proxy_idle[PROXY_MAX_ROUTES];
+__thread unsigned int proxy_nidle[PROXY_MAX_ROUTES];
+
+/*cdata->pstate, where a proxied request is at*/
+enum {
+	/*Getting a backend connection*/
+	PROXY_CONNECT,
+	/*Sending the request to the backend, from cdata->response*/
+	PROXY_REQUEST,
+	/*Waiting for the response header*/
+	PROXY_HEADER,
+	/*Sending cdata->response to the client, the header or chunk size lines*/
+	PROXY_FLUSH,
+	/*Splicing the body*/
+	PROXY_BODY,
+	/*Everything is sent*/
+	PROXY_DONE
+};
+
+/*cdata->pframe, how the end of the response body is found*/
+enum {
+	/*There is no body*/
+	FRAME_NONE,
+	/*Content-Length, tosend is what is left of it*/
+	FRAME_LENGTH,
+	/*Chunked, tosend is what is left of the chunk*/
+	FRAME_CHUNKED,
+	/*The backend closes the connection after it*/
+	FRAME_EOF
+};
+
+/*cdata->pchunk, where a chunked body is at*/
+enum {
+	/*The chunk size line comes next*/
+	CHUNK_SIZE,
+	/*tosend bytes of chunk data come next*/
+	CHUNK_DATA,
+	/*The empty line after the chunk data comes next*/
+	CHUNK_END,
+	/*Trailer lines, up to an empty one, come next*/
+	CHUNK_TRAILER,
+	/*The whole body has been read*/
+	CHUNK_DONE
+};
+
+/*Results of the steps of cb_proxy*/
+enum {
+	/*The state changed, the next step can run*/
+	PROXY_NEXT,
+	/*A socket would block, the next edge continues*/
+	PROXY_WAIT,
+	PROXY_FAIL
+};
+
+/*Adds a route from a -p argument like /api/=127.0.0.1:9000*/
+void proxy_add(const char *spec)
+{
+	int err;
+	size_t len;
+	char *host;
+	const char *eq, *colon;
+	proxy_route_t *route;
+	struct addrinfo hints;
+
+	if (proxy_nroutes >= PROXY_MAX_ROUTES)
+		die("At most %d proxy routes\n", PROXY_MAX_ROUTES);
+
+	eq = strchr(spec, '=');
+	if (!eq || (eq == spec) || (spec[0] != '/') || !(colon = strrchr(eq, ':')) ||
+	    (colon == (eq+1)) || !colon[1])
+		die("Proxy route must look like /prefix/=host:port\n");
+
+	route = &proxy_routes[proxy_nroutes++];
+	route->prefixlen = eq - spec;
+	route->prefix    = palloc(sizeof(char), route->prefixlen + 1);
+	memcpy(route->prefix, spec, route->prefixlen);
+
+	/*IPv6 addresses come in brackets, so the port can be told apart*/
+	eq++;
+	len = colon - eq;
+	if ((len > 2) && (eq[0] == '[') && (eq[len-1] == ']')) {
+		eq++;
+		len -= 2;
+	}
+	host = palloc(sizeof(char), len + 1);
+	memcpy(host, eq, len);
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family   = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if ((err = getaddrinfo(host, colon + 1, &hints, &route->addrs)))
+		die("Failed to resolve proxy backend %s: %s\n", host, gai_strerror(err));
+	free(host);
+}
+
+/*Starts a nonblocking connect to the route's backend, trying its
+  addresses in order until one doesn't fail right away*/
+int proxy_socket(proxy_route_t *route)
+{
+	int fd;
+	struct addrinfo *addr;
+
+	for (addr = route->addrs; addr; addr = addr->ai_next) {
+		fd = socket(addr->ai_family, addr->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+			    addr->ai_protocol);
+		if (fd < 0)
+			continue;
+
+		if (!connect(fd, addr->ai_addr, addr->ai_addrlen) || (errno == EINPROGRESS))
+			return fd;
+		close(fd);
+	}
+
+	return -1;
+}
+
+/*Returns the route of the request at the front of the request buffer, -1 if it has none*/
+int proxy_route(client_data_t *cdata)
+{
+	unsigned int i;
+	token target;
+
+	if (!proxy_nroutes || (cdata->tokenslen < 3))
+		return -1;
+
+	/*Anything else is refused with a 501 the same as it would be for a file*/
+	if (!tokeq(cdata->tokens[0], "GET") && !tokeq(cdata->tokens[0], "HEAD"))
+		return -1;
+
+	target = cdata->tokens[1];
+	for (i = 0; i < proxy_nroutes; i++) {
+		if ((target.len >= proxy_routes[i].prefixlen) &&
+		    !memcmp(target.str, proxy_routes[i].prefix, proxy_routes[i].prefixlen))
+			return i;
+	}
+
+	return -1;
+}
+
+/*Removes an idle backend connection from its route's list*/
+void proxy_idle_remove(client_data_t *up)
+{
+	if (!up->rprev)
+		return;
+
+	*up->rprev = up->rnext;
+	if (up->rnext)
+		up->rnext->rprev = up->rprev;
+	up->rnext = NULL;
+	up->rprev = NULL;
+	proxy_nidle[up->proute]--;
+	timer_cancel(up);
+}
+
+/*Starts answering the request at the front of the request buffer from route's
+  backend. The request for the backend is built in cdata->response, and the
+  request is dropped from the request buffer right away, like an answered one.
+  Returns false if the connection should be closed.*/
+bool proxy_start(client_data_t *cdata, int route)
+{
+	size_t i, requestlen;
+	token name, value;
+	request_t req;
+
+	/*Only for the client's keep-alive, the rest is up to the backend*/
+	parse_headers(cdata, &req);
+
+	if ((cdata->tokens[1].len + 18) > headerlen)
+		return false;
+
+	strappend(cdata, req.head ? "HEAD " : "GET ");
+	bufappend(cdata, cdata->tokens[1].str, cdata->tokens[1].len);
+	strappend(cdata, " HTTP/1.1\r\n");
+
+	for (i = 3; (i+1) < cdata->tokenslen; i += 2) {
+		name  = cdata->tokens[i];
+		value = cdata->tokens[i+1];
+		if (tokcaseeq(name, "Connection") || tokcaseeq(name, "Keep-Alive"))
+			continue;
+
+		/*bufappend would run past the buffer*/
+		if ((cdata->responselen + name.len + value.len + 6) > headerlen)
+			return false;
+
+		bufappend(cdata, name.str, name.len);
+		strappend(cdata, ": ");
+		bufappend(cdata, value.str, value.len);
+		strappend(cdata, "\r\n");
+	}
+	strappend(cdata, "\r\n");
+
+	/*Drops the forwarded request, the next one moves to the front*/
+	requestlen = cdata->parse_pos;
+	cdata->request_recvd -= requestlen;
+	memmove(cdata->request, cdata->request + requestlen, cdata->request_recvd);
+	parse_reset(cdata);
+
+	cdata->proute  = route;
+	cdata->pstate  = PROXY_CONNECT;
+	cdata->pframe  = req.head ? FRAME_NONE : FRAME_LENGTH;
+	cdata->preused = false;
+	cdata->pipelen = 0;
+	cdata->batched = 1;
+	cdata->cb_func = cb_proxy;
+	/*Only sending to the client can block on the client's socket*/
+	cdata->waiting = EPOLLOUT;
+
+	return true;
+}
+
+/*Gets a backend connection for cdata, an idle one unless retrying*/
+int proxy_connect(client_data_t *cdata, int efd)
+{
+	int fd, one;
+	client_data_t *up;
+	proxy_route_t *route;
+	struct epoll_event event;
+
+	if (!cdata->preused && (up = proxy_idle[cdata->proute])) {
+		proxy_idle_remove(up);
+		cdata->preused = true;
+	} else {
+		route = &proxy_routes[cdata->proute];
+		cdata->preused = false;
+
+		/*The connect finishes in the background, sending waits for it*/
+		if ((fd = proxy_socket(route)) < 0)
+			return PROXY_FAIL;
+		if (!(up = alloc_cdata())) {
+			close(fd);
+			return PROXY_FAIL;
+		}
+
+		/*The request goes out in one piece, there is nothing to wait for*/
+		one = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+		up->fd         = fd;
+		up->rfd        = -1;
+		up->waiting    = 0;
+		up->file       = NULL;
+		up->cb_func    = cb_upstream;
+		up->proute     = cdata->proute;
+		event.data.ptr = up;
+		event.events   = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+		if (epoll_ctl(efd, EPOLL_CTL_ADD, fd, &event) < 0)
+			die("EPOLL_CTL_ADD\n");
+	}
+
+	/*Errors and hang ups are handled by the steps running into them*/
+	up->waiting = EPOLLIN | EPOLLOUT | EPOLLERR | EPOLLHUP;
+	up->peer    = cdata;
+	cdata->peer = up;
+
+	cdata->response_sent = 0;
+	cdata->pstate        = PROXY_REQUEST;
+	return PROXY_NEXT;
+}
+
+int proxy_request(client_data_t *cdata)
+{
+	ssize_t ret;
+
+	while (cdata->response_sent < cdata->responselen) {
+		ret = send(cdata->peer->fd, cdata->response + cdata->response_sent,
+			   cdata->responselen - cdata->response_sent, 0);
+		/*ENOTCONN while the connect is still going*/
+		if (would_block(ret) || ((ret < 0) && (errno == ENOTCONN)))
+			return PROXY_WAIT;
+		if (ret <= 0)
+			return PROXY_FAIL;
+
+		cdata->response_sent += ret;
+		timer_arm(cdata, TIMER_SEND);
+	}
+
+	cdata->pstate = PROXY_HEADER;
+	return PROXY_NEXT;
+}
+
+/*Returns true if the backend has closed or reset the connection, which
+  peeking doesn't show while part of a line is still queued in front of it*/
+bool proxy_hung_up(int fd)
+{
+	struct pollfd pfd;
+
+	pfd.fd     = fd;
+	pfd.events = POLLRDHUP;
+	return (poll(&pfd, 1, 0) > 0) && (pfd.revents & (POLLRDHUP | POLLHUP | POLLERR));
+}
+
+/*Returns true if close is one of the options of a Connection field*/
+bool proxy_has_close(const char *p, const char *last)
+{
+	for (; (p + 5) <= last; p++) {
+		if (!strncasecmp(p, "close", 5))
+			return true;
+	}
+
+	return false;
+}
+
+/*Reads the response header into cdata->response, without reading any of the
+  body, and turns it into the header sent to the client*/
+int proxy_header(client_data_t *cdata)
+{
+	ssize_t ret;
+	size_t len, pos, linelen;
+	char *buf, *line, *end, *colon, *out;
+	bool reuse, chunked, length;
+	int status;
+
+	buf = cdata->response;
+
+	/*Leaves room for the Connection line*/
+	ret = recv(cdata->peer->fd, buf, headerlen - 32, MSG_PEEK);
+	if (would_block(ret))
+		return PROXY_WAIT;
+	if (ret <= 0)
+		return PROXY_FAIL;
+	/*The peek wrote over the request, so it can't be retried anymore.
+	  A backend that has started answering isn't a stale pooled one either.*/
+	cdata->preused = false;
+
+	if (!(end = memmem(buf, ret, "\r\n\r\n", 4))) {
+		if (((size_t)ret >= (headerlen - 32)) || proxy_hung_up(cdata->peer->fd))
+			return PROXY_FAIL;
+		return PROXY_WAIT;
+	}
+
+	/*Takes exactly the header off the socket*/
+	len = (end - buf) + 4;
+	if (recv(cdata->peer->fd, buf, len, 0) != (ssize_t)len)
+		return PROXY_FAIL;
+	timer_arm(cdata, TIMER_SEND);
+
+	if ((len < 12) || memcmp(buf, "HTTP/1.", 7) || !isdigit((unsigned char)buf[9]))
+		return PROXY_FAIL;
+	status = atoi(buf + 9);
+	/*Interim responses aren't expected for requests without a body*/
+	if (status < 200)
+		return PROXY_FAIL;
+
+	/*HTTP/1.0 backends close unless asked not to, and they weren't*/
+	reuse   = (buf[7] == '1');
+	chunked = length = false;
+
+	/*Copies the header over itself, dropping the hop-by-hop fields*/
+	line = out = (char *)memchr(buf, '\n', len) + 1;
+	for (pos = line - buf; pos < (len - 2); pos += linelen, line += linelen) {
+		linelen = (char *)memchr(line, '\n', len - pos) - line + 1;
+		colon   = memchr(line, ':', linelen);
+
+		if (colon && ((colon - line) == 10) && !strncasecmp(line, "Connection", 10)) {
+			if (proxy_has_close(colon + 1, line + linelen))
+				reuse = false;
+			continue;
+		}
+		if (colon && ((colon - line) == 10) && !strncasecmp(line, "Keep-Alive", 10))
+			continue;
+
+		if (colon && ((colon - line) == 17) && !strncasecmp(line, "Transfer-Encoding", 17))
+			chunked = true;
+		if (colon && ((colon - line) == 14) && !strncasecmp(line, "Content-Length", 14)) {
+			length        = true;
+			cdata->tosend = strtoull(colon + 1, NULL, 10);
+		}
+
+		memmove(out, line, linelen);
+		out += linelen;
+	}
+	cdata->responselen   = out - buf;
+	cdata->response_sent = 0;
+
+	/*HEAD and these statuses never have a body, whatever the header says*/
+	if ((cdata->pframe == FRAME_NONE) || (status == 204) || (status == 304))
+		cdata->pframe = FRAME_NONE;
+	else if (chunked) {
+		cdata->pframe = FRAME_CHUNKED;
+		cdata->pchunk = CHUNK_SIZE;
+		cdata->tosend = 0;
+	} else if (length)
+		cdata->pframe = FRAME_LENGTH;
+	else {
+		cdata->pframe    = FRAME_EOF;
+		cdata->keepalive = false;
+		reuse            = false;
+	}
+	cdata->preused = reuse;
+
+	if (cdata->keepalive)
+		strappend(cdata, "Connection: Keep-Alive\r\n\r\n");
+	else
+		strappend(cdata, "Connection: close\r\n\r\n");
+
+	metrics_status(buf[9]);
+
+	if ((cdata->pframe != FRAME_NONE) && (cdata->pipefd[0] < 0) &&
+	    (pipe2(cdata->pipefd, O_NONBLOCK | O_CLOEXEC) < 0)) {
+		cdata->pipefd[0] = cdata->pipefd[1] = -1;
+		return PROXY_FAIL;
+	}
+
+	cdata->pstate = PROXY_FLUSH;
+	return PROXY_NEXT;
+}
+
+/*True once every byte of the body has been read from the backend*/
+bool proxy_body_read(client_data_t *cdata)
+{
+	switch (cdata->pframe) {
+	case FRAME_NONE:
+		return true;
+	case FRAME_LENGTH:
+		return !cdata->tosend;
+	case FRAME_CHUNKED:
+		return cdata->pchunk == CHUNK_DONE;
+	}
+
+	return false;
+}
+
+/*Sends cdata->response to the client*/
+int proxy_flush(client_data_t *cdata)
+{
+	ssize_t ret;
+
+	while (cdata->response_sent < cdata->responselen) {
+		/*A body that follows leaves in the same segment*/
+		ret = send(cdata->fd, cdata->response + cdata->response_sent,
+			   cdata->responselen - cdata->response_sent,
+			   proxy_body_read(cdata) ? 0 : MSG_MORE);
+		if (would_block(ret)) {
+			wmetrics->eagain_send++;
+			return PROXY_WAIT;
+		}
+		if (ret <= 0)
+			return PROXY_FAIL;
+
+		cdata->response_sent   += ret;
+		wmetrics->bytes_header += ret;
+		timer_arm(cdata, TIMER_SEND);
+	}
+
+	cdata->responselen   = 0;
+	cdata->response_sent = 0;
+	cdata->pstate        = proxy_body_read(cdata) ? PROXY_DONE : PROXY_BODY;
+	return PROXY_NEXT;
+}
+
+/*Reads the lines between the chunks of a chunked body into cdata->response,
+  for proxy_flush to send. Only ever peeks past the end of a line.*/
+int proxy_chunk_lines(client_data_t *cdata)
+{
+	ssize_t ret;
+	size_t len, size;
+	char *line, *end;
+
+	while (cdata->pchunk != CHUNK_DATA) {
+		if (cdata->pchunk == CHUNK_DONE)
+			break;
+
+		/*Lines are written where they will be sent from*/
+		if ((cdata->responselen + proxy_maxline) > headerlen)
+			break;
+		line = cdata->response + cdata->responselen;
+
+		ret = recv(cdata->peer->fd, line, proxy_maxline, MSG_PEEK);
+		if (would_block(ret)) {
+			if (cdata->responselen)
+				break;
+			return PROXY_WAIT;
+		}
+		if (ret <= 0)
+			return PROXY_FAIL;
+		if (!(end = memmem(line, ret, "\r\n", 2))) {
+			if (((size_t)ret >= proxy_maxline) || proxy_hung_up(cdata->peer->fd))
+				return PROXY_FAIL;
+			if (cdata->responselen)
+				break;
+			return PROXY_WAIT;
+		}
+
+		len = (end - line) + 2;
+		if (recv(cdata->peer->fd, line, len, 0) != (ssize_t)len)
+			return PROXY_FAIL;
+		cdata->responselen += len;
+
+		switch (cdata->pchunk) {
+		case CHUNK_END:
+			if (len != 2)
+				return PROXY_FAIL;
+			cdata->pchunk = CHUNK_SIZE;
+			break;
+		case CHUNK_SIZE:
+			/*Chunk extensions after the size are passed along*/
+			if (!isxdigit((unsigned char)line[0]))
+				return PROXY_FAIL;
+			size = strtoull(line, NULL, 16);
+			cdata->tosend = size;
+			cdata->pchunk = size ? CHUNK_DATA : CHUNK_TRAILER;
+			break;
+		case CHUNK_TRAILER:
+			if (len == 2)
+				cdata->pchunk = CHUNK_DONE;
+			break;
+		}
+	}
+
+	cdata->pstate = PROXY_FLUSH;
+	return PROXY_NEXT;
+}
+
+/*Splices the body from the backend to the client through the pipe,
+  a send budget at a time like cb_sendfile*/
+int proxy_body(client_data_t *cdata)
+{
+	ssize_t ret;
+	size_t len, budget;
+
+	budget = send_budget;
+
+	while (true) {
+		/*What is in the pipe goes out before anything else*/
+		if (cdata->pipelen) {
+			ret = splice(cdata->pipefd[0], NULL, cdata->fd, NULL, cdata->pipelen,
+				     SPLICE_F_MOVE | SPLICE_F_NONBLOCK |
+				     (proxy_body_read(cdata) ? 0 : SPLICE_F_MORE));
+			if (would_block(ret)) {
+				wmetrics->eagain_send++;
+				return PROXY_WAIT;
+			}
+			if (ret <= 0)
+				return PROXY_FAIL;
+
+			cdata->pipelen -= ret;
+			budget         -= ((size_t)ret < budget) ? (size_t)ret : budget;
+			wmetrics->bytes_proxy += ret;
+			timer_arm(cdata, TIMER_SEND);
+			continue;
+		}
+
+		if (proxy_body_read(cdata)) {
+			cdata->pstate = PROXY_DONE;
+			return PROXY_NEXT;
+		}
+
+		/*Chunk data has been sent, the lines up to the next chunk are read*/
+		if ((cdata->pframe == FRAME_CHUNKED) && !cdata->tosend) {
+			if (cdata->pchunk == CHUNK_DATA)
+				cdata->pchunk = CHUNK_END;
+			return proxy_chunk_lines(cdata);
+		}
+
+		/*The others get their turn, see cb_sendfile*/
+		if (!budget) {
+			cdata->waiting = 0;
+			ready_push(cdata);
+			wmetrics->send_yields++;
+			return PROXY_WAIT;
+		}
+
+		/*The pipe is empty here, so only the backend can block*/
+		len = ((cdata->pframe == FRAME_EOF) || (cdata->tosend > proxy_chunk)) ?
+		      proxy_chunk : cdata->tosend;
+		ret = splice(cdata->peer->fd, NULL, cdata->pipefd[1], NULL, len,
+			     SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (would_block(ret))
+			return PROXY_WAIT;
+		if (ret < 0)
+			return PROXY_FAIL;
+		if (!ret) {
+			if (cdata->pframe != FRAME_EOF)
+				return PROXY_FAIL;
+			cdata->pstate = PROXY_DONE;
+			return PROXY_NEXT;
+		}
+
+		cdata->pipelen += ret;
+		if (cdata->pframe != FRAME_EOF)
+			cdata->tosend -= ret;
+	}
+}
+
+/*Returns the backend connection to its pool, or closes it*/
+void proxy_release(client_data_t *cdata, bool reuse, int efd)
+{
+	client_data_t *up;
+	unsigned int route;
+
+	if (!(up = cdata->peer))
+		return;
+	cdata->peer = NULL;
+	up->peer    = NULL;
+	route       = up->proute;
+
+	if (!reuse || (proxy_nidle[route] >= proxy_maxidle) || end_program || draining) {
+		close_client(up, efd);
+		return;
+	}
+
+	/*Anything it has to say from now on is the backend hanging up*/
+	up->waiting = EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP;
+	up->rnext   = proxy_idle[route];
+	up->rprev   = &proxy_idle[route];
+	if (up->rnext)
+		up->rnext->rprev = &up->rnext;
+	proxy_idle[route] = up;
+	proxy_nidle[route]++;
+	timer_arm(up, TIMER_IDLE);
+}
+
+/*Renders a 502 in place of whatever was in cdata->response*/
+void proxy_bad_gateway(client_data_t *cdata)
+{
+	cdata->responselen   = 0;
+	cdata->response_sent = 0;
+	cdata->readfile      = false;
+	cdata->body          = NULL;
+	strappend(cdata, "HTTP/1.1 502 Bad Gateway\r\nContent-Length: 0\r\nServer: httpc\r\n");
+	bufappend(cdata, date_line, sizeof(date_line));
+	if (cdata->keepalive)
+		strappend(cdata, "Connection: Keep-Alive\r\n\r\n");
+	else
+		strappend(cdata, "Connection: close\r\n\r\n");
+	metrics_status('5');
+}
+
+/*Answers 502 if nothing has been sent to the client yet, and closes it otherwise.
+  A pooled connection the backend closed in the meantime is retried on a new one.*/
+bool proxy_fail(client_data_t *cdata, int efd)
+{
+	bool retry;
+
+	retry = cdata->preused && (cdata->pstate <= PROXY_HEADER);
+	proxy_release(cdata, false, efd);
+
+	if (cdata->pstate > PROXY_HEADER) {
+		close_client(cdata, efd);
+		return false;
+	}
+
+	/*The request is still in cdata->response, proxy_header clears
+	  preused once it reads anything over it*/
+	if (retry) {
+		cdata->pstate = PROXY_CONNECT;
+		return true;
+	}
+
+	proxy_bad_gateway(cdata);
+
+	cdata->waiting = EPOLLOUT;
+	cdata->cb_func = cb_send;
+	return true;
+}
+
+/*Callback of a client whose request is being proxied, runs until a socket blocks*/
+bool cb_proxy(client_data_t *cdata, int efd)
+{
+	int ret;
+
+	while (true) {
+		switch (cdata->pstate) {
+		case PROXY_CONNECT:
+			ret = proxy_connect(cdata, efd);
+			break;
+		case PROXY_REQUEST:
+			ret = proxy_request(cdata);
+			break;
+		case PROXY_HEADER:
+			ret = proxy_header(cdata);
+			break;
+		case PROXY_FLUSH:
+			ret = proxy_flush(cdata);
+			break;
+		case PROXY_BODY:
+			ret = proxy_body(cdata);
+			break;
+		default:
+			proxy_release(cdata, cdata->preused, efd);
+			return response_done(cdata, efd);
+		}
+
+		if (ret == PROXY_WAIT)
+			return false;
+		if (ret == PROXY_FAIL)
+			return proxy_fail(cdata, efd);
+	}
+}
+
+/*Callback of a backend connection, events on it move its client along*/
+bool cb_upstream(client_data_t *up, int efd)
+{
+	char c;
+	ssize_t ret;
+	client_data_t *cdata;
+
+	/*Idle connections have nothing to say, so unless the edge is
+	  left over from the last response, the backend is hanging up*/
+	if (!(cdata = up->peer)) {
+		ret = recv(up->fd, &c, 1, MSG_PEEK);
+		if (!would_block(ret))
+			close_client(up, efd);
+		return false;
+	}
+
+	/*Its client gets its turn from the ready queue*/
+	if (cdata->rprev)
+		return false;
+
+	while (cdata->cb_func(cdata, efd));
+	return false;
+}
+
+/*Closes the idle backend connections of a draining worker*/
+void proxy_drain(int efd)
+{
+	unsigned int i;
+
+	for (i = 0; i < proxy_nroutes; i++) {
+		while (proxy_idle[i])
+			close_client(proxy_idle[i], efd);
+	}
+}
+
+/*Called by close_client, before closing either kind of connection*/
+void proxy_close(client_data_t *cdata, int efd)
+{
+	client_data_t *up;
+
+	if (cdata->cb_func == cb_upstream) {
+		proxy_idle_remove(cdata);
+		if (cdata->peer)
+			cdata->peer->peer = NULL;
+		cdata->peer = NULL;
+		return;
+	}
+
+	/*The response was cut short, so the backend connection can't be reused*/
+	if ((up = cdata->peer)) {
+		cdata->peer = NULL;
+		up->peer    = NULL;
+		close_client(up, efd);
+	}
+}
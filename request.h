@@ -0,0 +1,227 @@
+/*Incremental request parser: scans the request buffer, keeping its state in
+  cdata between calls, so every received byte is looked at once no matter how
+  the request is split up over recv calls. Inside tokens the kernels in scan.h
+  skip ahead to the next byte that matters, the state machine handles that one.*/
+/*The request is never written to, the parser only records where things are:
+  cdata->tokens[0], [1] and [2] are the method, target and version, followed
+  by a name and value pair for every header field. Names don't include the
+  colon, and values have the white space around them stripped.*/
+
+/*Parser states, named after what the next byte is expected to be part of*/
+enum {
+	/*Empty lines in front of the request line, which are ignored*/
+	PARSE_START,
+	PARSE_METHOD,
+	PARSE_TARGET_START,
+	PARSE_TARGET,
+	PARSE_VERSION_START,
+	PARSE_VERSION,
+	/*A carriage return ended the line, the line feed comes next*/
+	PARSE_LINE_LF,
+	/*A header field, or the empty line that ends the header*/
+	PARSE_FIELD_START,
+	PARSE_NAME,
+	PARSE_VALUE_START,
+	PARSE_VALUE,
+	/*Carriage return of the empty line that ends the header*/
+	PARSE_END_LF,
+	/*Final states, parse_request keeps returning the same result*/
+	PARSE_COMPLETE,
+	PARSE_FAILED
+};
+
+/*Results of parse_request*/
+enum {
+	PARSE_INCOMPLETE,
+	PARSE_DONE,
+	PARSE_ERROR
+};
+
+/*Starts over with a new request at the front of the request buffer*/
+void parse_reset(client_data_t *cdata)
+{
+	cdata->parse_state = PARSE_START;
+	cdata->parse_pos   = 0;
+	cdata->parse_mark  = 0;
+	cdata->tokenslen   = 0;
+}
+
+/*Records a token, header fields that don't fit in cdata->tokens are dropped.
+  A value is only kept when its name was, which is when tokenslen is even.*/
+void parse_token(client_data_t *cdata, unsigned int start, unsigned int end, bool value)
+{
+	token *tok;
+
+	if (value ? (cdata->tokenslen % 2) : ((cdata->tokenslen + 2) > maxtokens))
+		return;
+
+	tok      = &cdata->tokens[cdata->tokenslen++];
+	tok->str = cdata->request + start;
+	tok->len = end - start;
+}
+
+/*Scans the bytes received since the last call. Returns PARSE_DONE once the
+  header is complete, with cdata->parse_pos right after it, PARSE_INCOMPLETE
+  if more has to be received, and PARSE_ERROR for requests that are malformed.*/
+int parse_request(client_data_t *cdata)
+{
+	char c;
+	unsigned int pos, end;
+	unsigned char state;
+
+	state = cdata->parse_state;
+	if (state == PARSE_COMPLETE)
+		return PARSE_DONE;
+	if (state == PARSE_FAILED)
+		return PARSE_ERROR;
+
+	for (pos = cdata->parse_pos; pos < cdata->request_recvd; pos++) {
+		switch (state) {
+		case PARSE_METHOD:
+		case PARSE_TARGET:
+		case PARSE_VERSION:
+			pos += scan_ctl(cdata->request + pos, cdata->request_recvd - pos, ' ');
+			break;
+		case PARSE_NAME:
+			pos += scan_ctl(cdata->request + pos, cdata->request_recvd - pos, ':');
+			break;
+		case PARSE_VALUE:
+			pos += scan_eol(cdata->request + pos, cdata->request_recvd - pos);
+			break;
+		}
+		if (pos >= cdata->request_recvd)
+			break;
+
+		c = cdata->request[pos];
+
+		switch (state) {
+		case PARSE_START:
+			if ((c == '\r') || (c == '\n'))
+				break;
+
+			cdata->parse_mark = pos;
+			state = PARSE_METHOD;
+			break;
+		case PARSE_METHOD:
+			if (c == ' ') {
+				parse_token(cdata, cdata->parse_mark, pos, false);
+				state = PARSE_TARGET_START;
+			} else if ((c == '\r') || (c == '\n'))
+				goto fail;
+			break;
+		case PARSE_TARGET_START:
+		case PARSE_VERSION_START:
+			if (c == ' ')
+				break;
+			if ((c == '\r') || (c == '\n'))
+				goto fail;
+
+			cdata->parse_mark = pos;
+			state = (state == PARSE_TARGET_START) ? PARSE_TARGET : PARSE_VERSION;
+			break;
+		case PARSE_TARGET:
+			if (c == ' ') {
+				parse_token(cdata, cdata->parse_mark, pos, false);
+				state = PARSE_VERSION_START;
+			/*http/0.9 requests have no version, and aren't supported.
+			  Null bytes would cut the path short when it is opened.*/
+			} else if ((c == '\r') || (c == '\n') || !c)
+				goto fail;
+			break;
+		case PARSE_VERSION:
+			/*Bare line feeds are accepted as line endings, as the spec allows*/
+			if ((c == '\r') || (c == '\n')) {
+				parse_token(cdata, cdata->parse_mark, pos, false);
+				state = (c == '\r') ? PARSE_LINE_LF : PARSE_FIELD_START;
+			} else if ((c == ' ') || (c == '\t'))
+				goto fail;
+			break;
+		case PARSE_LINE_LF:
+			if (c != '\n')
+				goto fail;
+
+			state = PARSE_FIELD_START;
+			break;
+		case PARSE_FIELD_START:
+			if (c == '\r')
+				state = PARSE_END_LF;
+			else if (c == '\n')
+				goto done;
+			/*Values folded over several lines are obsolete, and rejected*/
+			else if ((c == ' ') || (c == '\t') || (c == ':'))
+				goto fail;
+			else {
+				cdata->parse_mark = pos;
+				state = PARSE_NAME;
+			}
+			break;
+		case PARSE_NAME:
+			if (c == ':') {
+				parse_token(cdata, cdata->parse_mark, pos, false);
+				state = PARSE_VALUE_START;
+			/*White space between the name and the colon isn't allowed*/
+			} else if ((c == ' ') || (c == '\t') || (c == '\r') || (c == '\n'))
+				goto fail;
+			break;
+		case PARSE_VALUE_START:
+			if ((c == ' ') || (c == '\t'))
+				break;
+
+			cdata->parse_mark = pos;
+			state = PARSE_VALUE;
+			/*fall through*/
+		case PARSE_VALUE:
+			if ((c == '\r') || (c == '\n')) {
+				/*Trailing white space is left out*/
+				for (end = pos; (end > cdata->parse_mark) &&
+				     ((cdata->request[end-1] == ' ') || (cdata->request[end-1] == '\t')); end--);
+
+				parse_token(cdata, cdata->parse_mark, end, true);
+				state = (c == '\r') ? PARSE_LINE_LF : PARSE_FIELD_START;
+			}
+			break;
+		case PARSE_END_LF:
+			if (c != '\n')
+				goto fail;
+			goto done;
+		}
+	}
+
+	cdata->parse_state = state;
+	cdata->parse_pos   = pos;
+	return PARSE_INCOMPLETE;
+
+done:
+	cdata->parse_state = PARSE_COMPLETE;
+	cdata->parse_pos   = pos + 1;
+	return PARSE_DONE;
+
+fail:
+	cdata->parse_state = PARSE_FAILED;
+	return PARSE_ERROR;
+}
+
+/*Compares a token to a string, case sensitive like methods and versions*/
+bool tokeq(token tok, const char *str)
+{
+	return (strlen(str) == tok.len) && !memcmp(tok.str, str, tok.len);
+}
+
+/*Compares a token to a string, case insensitive like header names*/
+bool tokcaseeq(token tok, const char *str)
+{
+	return (strlen(str) == tok.len) && !strncasecmp(tok.str, str, tok.len);
+}
+
+/*Copies a token into buf as a null terminated string.
+  Values too long for buf are left empty, rather than cut short and misread.*/
+void tokcpy(char *buf, size_t buflen, token tok)
+{
+	if (tok.len >= buflen) {
+		buf[0] = '\0';
+		return;
+	}
+
+	memcpy(buf, tok.str, tok.len);
+	buf[tok.len] = '\0';
+}
@@ -0,0 +1,578 @@
+/*Checks an If-None-Match list like '"a", W/"b"' for the entity tag of a file.
+  Weak comparison is used, as the spec requires for If-None-Match.*/
+bool etag_listmatch(token list, const char *etag, size_t etaglen)
+{
+	const char *p, *end, *last;
+
+	last = list.str + list.len;
+	for (p = list.str; p < last; p = end) {
+		/*Skips separators*/
+		while ((p < last) && ((*p == ',') || (*p == ' ') || (*p == '\t')))
+			p++;
+		if (p >= last)
+			break;
+
+		if (*p == '*')
+			return true;
+
+		if (((last - p) >= 2) && !memcmp(p, "W/", 2))
+			p += 2;
+
+		/*Entity tags are quoted, and can't contain quotes themselves*/
+		if ((p < last) && (*p == '"') && (end = memchr(p+1, '"', last - (p+1))))
+			end++;
+		else if (!(end = memchr(p, ',', last - p)))
+			end = last;
+
+		if (((size_t)(end - p) == etaglen) && !memcmp(p, etag, etaglen))
+			return true;
+	}
+
+	return false;
+}
+
+/*Results of parse_range*/
+enum {
+	/*No usable Range header, the whole file is sent*/
+	RANGE_NONE,
+	/*A single satisfiable range*/
+	RANGE_OK,
+	/*Syntactically valid, but starts past the end of the file*/
+	RANGE_UNSATISFIABLE
+};
+
+/*Parses a single byte range like "bytes=0-99", "bytes=100-", or "bytes=-100".
+  Invalid and multiple ranges are treated as if there was no Range header,
+  which the spec allows. The range is clamped to the file size.*/
+int parse_range(const char *spec, off_t size, off_t *start, off_t *end)
+{
+	char *p;
+	unsigned long long first, last;
+
+	if (strncasecmp(spec, "bytes=", 6))
+		return RANGE_NONE;
+	spec += 6;
+
+	/*Multiple ranges would need multipart/byteranges*/
+	if (strchr(spec, ','))
+		return RANGE_NONE;
+
+	/*Suffix range, the last n bytes of the file*/
+	if (*spec == '-') {
+		if (!isdigit((unsigned char)spec[1]))
+			return RANGE_NONE;
+
+		errno = 0;
+		last  = strtoull(spec+1, &p, 10);
+		if (*p || errno)
+			return RANGE_NONE;
+		if (!last)
+			return RANGE_UNSATISFIABLE;
+
+		*start = ((off_t)last < size) ? (size - (off_t)last) : 0;
+		*end   = size - 1;
+		return RANGE_OK;
+	}
+
+	if (!isdigit((unsigned char)*spec))
+		return RANGE_NONE;
+
+	errno = 0;
+	first = strtoull(spec, &p, 10);
+	if ((*p != '-') || errno)
+		return RANGE_NONE;
+	p++;
+
+	if (*p) {
+		if (!isdigit((unsigned char)*p))
+			return RANGE_NONE;
+
+		last = strtoull(p, &p, 10);
+		if (*p || errno || (last < first))
+			return RANGE_NONE;
+	} else
+		/*Open ended, goes to the end of the file*/
+		last = (unsigned long long)size - 1;
+
+	if (first >= (unsigned long long)size)
+		return RANGE_UNSATISFIABLE;
+
+	*start = (off_t)first;
+	*end   = (last < (unsigned long long)size) ? (off_t)last : (size - 1);
+	return RANGE_OK;
+}
+
+/*Returns true if an Accept-Encoding value like "gzip, br;q=0.5" allows coding.
+  A q-value of zero refuses a coding, and * stands for every coding not listed.*/
+bool accepts_encoding(const char *list, const char *coding)
+{
+	size_t len;
+	bool star;
+	const char *p, *end, *param;
+
+	star = false;
+	for (p = list; *p; p = end) {
+		/*Skips separators*/
+		while ((*p == ',') || (*p == ' ') || (*p == '\t'))
+			p++;
+		if (!*p)
+			break;
+
+		end = p + strcspn(p, ",");
+		len = strcspn(p, " \t;,");
+
+		/*Only the q parameter means anything here*/
+		param = memchr(p, ';', end - p);
+		while (param && ((param[1] == ' ') || (param[1] == '\t')))
+			param++;
+
+		if ((len == strlen(coding)) && !strncasecmp(p, coding, len))
+			return !param || strncasecmp(param+1, "q=", 2) || (strtod(param+3, NULL) > 0);
+
+		if ((len == 1) && (*p == '*'))
+			star = !param || strncasecmp(param+1, "q=", 2) || (strtod(param+3, NULL) > 0);
+	}
+
+	return star;
+}
+
+/*If-Range holds either an entity tag or a date, the range is only
+  honoured if it still describes the same file, otherwise the whole file is sent*/
+bool ifrange_match(const char *value, fcache_entry_t *file)
+{
+	/*Only strong entity tags can match*/
+	if (*value == '"')
+		return !strcmp(value, file->etag);
+
+	return parse_http_date(value) == file->st.st_mtime;
+}
+
+/*Writes the part of a successful response header that only depends on the file,
+  from the status line up to and including the Content-Length line, which
+  empty files answered with a 204 don't get.
+  base is where the response starts in cdata->response.*/
+void fileheader_append(client_data_t *cdata, fcache_entry_t *file, size_t base)
+{
+	int i;
+	struct stat *fileinfo;
+
+	fileinfo = &file->st;
+
+	/*I believe this is required by http*/
+	if (!fileinfo->st_size)
+		/*I believe this is what is supposed to returned for zero length files*/
+		strappend(cdata, "204 No Content\r\n");
+	else
+		/*It's weird that this is the only response in the
+		spec where the word(s) following the status code is all caps*/
+		strappend(cdata, "200 OK\r\n");
+
+	/*Everything after the status line is shared with 304 responses*/
+	file->statuslen = cdata->responselen - base;
+
+	/*Write Last-Modified header for caching purposes*/
+	strappend (cdata, "Last-Modified: ");
+	dateappend(cdata, fileinfo->st_mtime);
+	strappend (cdata, "\r\n");
+
+	/*Strong validator for If-None-Match*/
+	strappend(cdata, "ETag: ");
+	strappend(cdata, file->etag);
+	strappend(cdata, "\r\n");
+
+	/*Precompressed siblings, caches have to keep the encodings apart*/
+	if (file->encoding >= 0) {
+		strappend(cdata, "Content-Encoding: ");
+		strappend(cdata, fcache_encoding[file->encoding]);
+		strappend(cdata, "\r\n");
+	}
+	for (i = 0; (i < FCACHE_ENCODINGS) && !file->variants[i]; i++);
+	if ((file->encoding >= 0) || (i < FCACHE_ENCODINGS))
+		strappend(cdata, "Vary: Accept-Encoding\r\n");
+
+	/*Clients can resume and seek with Range requests*/
+	strappend(cdata, "Accept-Ranges: bytes\r\n");
+
+	/*Might be useful for debugging*/
+	strappend(cdata, "Server: httpc\r\n");
+
+	/*Content-Length is last, since partial responses replace it*/
+	file->lengthpos = cdata->responselen - base;
+
+	/*204 responses must not have one (rfc 9110 8.6)*/
+	if (!fileinfo->st_size)
+		return;
+
+	/*Not required, but is a general service to
+	the client to include this, for caching and
+	verifying that the client got the file correctly*/
+	strappend (cdata, "Content-Length: ");
+	uintappend(cdata, fileinfo->st_size);
+	strappend (cdata, "\r\n");
+}
+
+/*Header fields gen_response understands*/
+enum {
+	HEADER_OTHER,
+	HEADER_RANGE,
+	HEADER_IF_RANGE,
+	HEADER_CONNECTION,
+	HEADER_IF_NONE_MATCH,
+	HEADER_ACCEPT_ENCODING,
+	HEADER_IF_MODIFIED_SINCE,
+	HEADER_CONTENT_LENGTH,
+	HEADER_TRANSFER_ENCODING
+};
+
+/*Identifies a header name by its length, so every name is compared against at
+  most one known name however many are understood. Names of the same length
+  would be told apart by a switch on a letter they differ in. Case insensitive.*/
+int header_lookup(token name)
+{
+	int id;
+	const char *known;
+
+	switch (name.len) {
+	case 5:
+		id    = HEADER_RANGE;
+		known = "Range";
+		break;
+	case 8:
+		id    = HEADER_IF_RANGE;
+		known = "If-Range";
+		break;
+	case 10:
+		id    = HEADER_CONNECTION;
+		known = "Connection";
+		break;
+	case 13:
+		id    = HEADER_IF_NONE_MATCH;
+		known = "If-None-Match";
+		break;
+	case 14:
+		id    = HEADER_CONTENT_LENGTH;
+		known = "Content-Length";
+		break;
+	case 15:
+		id    = HEADER_ACCEPT_ENCODING;
+		known = "Accept-Encoding";
+		break;
+	case 17:
+		if (tolower((unsigned char)name.str[0]) == 't') {
+			id    = HEADER_TRANSFER_ENCODING;
+			known = "Transfer-Encoding";
+		} else {
+			id    = HEADER_IF_MODIFIED_SINCE;
+			known = "If-Modified-Since";
+		}
+		break;
+	default:
+		return HEADER_OTHER;
+	}
+
+	/*The first letter rules out most unknown names without a full compare*/
+	if ((tolower((unsigned char)name.str[0]) != tolower((unsigned char)known[0])) ||
+	    strncasecmp(name.str, known, name.len))
+		return HEADER_OTHER;
+
+	return id;
+}
+
+/*What gen_response needs to know about a request, filled in by parse_headers*/
+typedef struct {
+	bool get, head;
+	/*Conditional request state, ims is -1 and inm.str is NULL without the header*/
+	time_t ims;
+	token inm;
+	/*Range request state, empty without the header*/
+	char range[64], ifrange[64];
+	/*Content negotiation state, empty without the header*/
+	char acceptenc[128];
+}request_t;
+
+/*Connection holds a comma separated list of case insensitive options,
+  close wins if keep-alive is in there as well*/
+void connection_options(client_data_t *cdata, token value)
+{
+	size_t len;
+	bool close, keepalive;
+	const char *p, *last;
+
+	close = keepalive = false;
+	last  = value.str + value.len;
+	for (p = value.str; p < last; p += len) {
+		/*Skips separators*/
+		while ((p < last) && ((*p == ',') || (*p == ' ') || (*p == '\t')))
+			p++;
+
+		for (len = 0; ((p + len) < last) && (p[len] != ',') &&
+		     (p[len] != ' ') && (p[len] != '\t'); len++);
+
+		if ((len == 5) && !strncasecmp(p, "close", 5))
+			close = true;
+		else if ((len == 10) && !strncasecmp(p, "keep-alive", 10))
+			keepalive = true;
+	}
+
+	if (close)
+		cdata->keepalive = false;
+	else if (keepalive)
+		cdata->keepalive = true;
+}
+
+/*Fills in req from the request line and header fields, each header field is
+  looked at once no matter how many of them gen_response understands*/
+void parse_headers(client_data_t *cdata, request_t *req)
+{
+	size_t i;
+	char date[64];
+	token version;
+	bool body;
+
+	body      = false;
+	req->get  = tokeq(cdata->tokens[0],  "GET");
+	req->head = tokeq(cdata->tokens[0], "HEAD");
+
+	/*http/1.0 connections close unless asked not to, and later versions
+	  stay open unless asked to close. The protocol name is case sensitive.*/
+	version          = cdata->tokens[2];
+	cdata->keepalive = !tokeq(version, "HTTP/1.0");
+
+	req->ims       = -1;
+	req->inm.str   = NULL;
+	req->inm.len   = 0;
+	req->range[0]  = req->ifrange[0] = req->acceptenc[0] = '\0';
+
+	/*The first three tokens are the request line, then come name and value pairs*/
+	for (i = 3; (i+1) < cdata->tokenslen; i += 2) {
+		switch (header_lookup(cdata->tokens[i])) {
+		case HEADER_CONNECTION:
+			connection_options(cdata, cdata->tokens[i+1]);
+			break;
+		case HEADER_IF_MODIFIED_SINCE:
+			tokcpy(date, sizeof(date), cdata->tokens[i+1]);
+			req->ims = parse_http_date(date);
+			break;
+		case HEADER_IF_NONE_MATCH:
+			req->inm = cdata->tokens[i+1];
+			break;
+		case HEADER_RANGE:
+			tokcpy(req->range, sizeof(req->range), cdata->tokens[i+1]);
+			break;
+		case HEADER_IF_RANGE:
+			tokcpy(req->ifrange, sizeof(req->ifrange), cdata->tokens[i+1]);
+			break;
+		case HEADER_ACCEPT_ENCODING:
+			tokcpy(req->acceptenc, sizeof(req->acceptenc), cdata->tokens[i+1]);
+			break;
+		case HEADER_CONTENT_LENGTH:
+			body |= !tokeq(cdata->tokens[i+1], "0");
+			break;
+		case HEADER_TRANSFER_ENCODING:
+			body = true;
+			break;
+		default:
+			break;
+		}
+	}
+
+	/*Request bodies are never read, so whatever follows one can't be told
+	  apart from the next request, and the connection closes after it.
+	  A draining process tells clients to take their next request elsewhere.*/
+	if (body || draining)
+		cdata->keepalive = false;
+}
+
+/*Parses tokenized request and generates a response*/
+bool gen_response(client_data_t *cdata)
+{
+	size_t i, base;
+	token tok;
+	bool notmodified;
+	request_t req;
+	fcache_entry_t *file, *variant;
+	struct stat fileinfo;
+	/*Range request state*/
+	int range;
+	off_t start, end;
+
+	/*Initialize response variables, the response is appended after
+	  the ones already queued for earlier pipelined requests*/
+	base                 = cdata->responselen;
+	cdata->readfile      = false;
+	cdata->body          = NULL;
+
+	/*A minimum of three is required for any verb*/
+	if (cdata->tokenslen < 3) {
+		cdata->keepalive = false;
+		return false;
+	}
+
+	parse_headers(cdata, &req);
+
+	/*Write version*/
+	strappend(cdata, "HTTP/1.1 ");
+
+	/*Check of supported http verbs*/
+	if (!req.get && !req.head) {
+		strappend(cdata, "501 Not Implemented\r\nContent-Length: 0\r\n");
+
+		goto conn_status;
+	}
+
+	/*File path, or at least it should be*/
+	tok = cdata->tokens[1];
+
+	/*Probe the file cache, which opens and stats the file on a miss.
+	  The metrics page is rendered instead, for local clients only.*/
+	if (tokeq(tok, metrics_path) && metrics_local(cdata->fd))
+		file = metrics_entry();
+	else
+		file = fcache_get(tok.str, tok.len);
+	if (!file) {
+		cdata->readfile = false;
+
+		/*Files that exist but can't be read*/
+		if (errno == EACCES || errno == EPERM) {
+			strappend(cdata, "403 Forbidden\r\nContent-Length: 0\r\n");
+			goto conn_status;
+		}
+
+		/*Out of descriptors with every cached file in use, the file
+		  may well exist and a retry can find one free*/
+		if (errno == EMFILE || errno == ENFILE) {
+			strappend(cdata, "503 Service Unavailable\r\nContent-Length: 0\r\nRetry-After: 1\r\n");
+			goto conn_status;
+		}
+
+		/*More informative output can be added later
+		  on using different http error codes depending on errno values*/
+		strappend(cdata, "404 File Not Found\r\nContent-Length: 0\r\n");
+
+		goto conn_status;
+	}
+
+	/*Swaps in the smallest precompressed sibling the client accepts,
+	  the siblings were found when the file was cached*/
+	if (req.acceptenc[0]) {
+		variant = NULL;
+		for (i = 0; i < FCACHE_ENCODINGS; i++) {
+			if (file->variants[i] && accepts_encoding(req.acceptenc, fcache_encoding[i]) &&
+			    (!variant || (file->variants[i]->st.st_size < variant->st.st_size)))
+				variant = file->variants[i];
+		}
+
+		if (variant) {
+			variant->refs++;
+			fcache_release(file);
+			file = variant;
+		}
+	}
+	fileinfo = file->st;
+
+	/*The whole file is sent unless a range was asked for*/
+	cdata->offset = 0;
+	cdata->tosend = fileinfo.st_size;
+
+	/*Everything up to the Connection line only depends on the file, so it is
+	  rendered on the first hit and copied out of the cache after that*/
+	if (!file->header) {
+		fileheader_append(cdata, file, base);
+		fcache_set_header(file, cdata->response + base, cdata->responselen - base);
+	}
+
+	/*If-None-Match takes precedence, If-Modified-Since is only
+	  looked at when there isn't one. Dates in the future are invalid.*/
+	if (req.inm.str)
+		notmodified = etag_listmatch(req.inm, file->etag, file->etaglen);
+	else
+		notmodified = (req.ims >= 0) && (req.ims <= date_now) && (fileinfo.st_mtime <= req.ims);
+
+	/*Range only applies to GET, and empty files have nothing to take a range of*/
+	range = RANGE_NONE;
+	if (req.get && req.range[0] && fileinfo.st_size && !notmodified &&
+	    (!req.ifrange[0] || ifrange_match(req.ifrange, file)))
+		range = parse_range(req.range, fileinfo.st_size, &start, &end);
+
+	if (notmodified) {
+		/*304 carries the same header fields a 200 would, but no body*/
+		cdata->responselen = base;
+		strappend(cdata, "HTTP/1.1 304 Not Modified\r\n");
+		memcpy(cdata->response + cdata->responselen, file->header + file->statuslen,
+		       file->headerlen - file->statuslen);
+		cdata->responselen += file->headerlen - file->statuslen;
+		cdata->tosend       = 0;
+	} else if (range == RANGE_UNSATISFIABLE) {
+		fcache_release(file);
+		cdata->readfile = false;
+
+		/*The header fileheader_append may have just rendered is dropped*/
+		cdata->responselen = base;
+		strappend (cdata, "HTTP/1.1 416 Range Not Satisfiable\r\n");
+		strappend (cdata, "Content-Range: bytes */");
+		uintappend(cdata, fileinfo.st_size);
+		strappend (cdata, "\r\nContent-Length: 0\r\n");
+		goto conn_status;
+	} else if (range == RANGE_OK) {
+		/*Same fields as a 200, except for the length of the body*/
+		cdata->responselen = base;
+		strappend(cdata, "HTTP/1.1 206 Partial Content\r\n");
+		memcpy(cdata->response + cdata->responselen, file->header + file->statuslen,
+		       file->lengthpos - file->statuslen);
+		cdata->responselen += file->lengthpos - file->statuslen;
+
+		cdata->offset = start;
+		cdata->tosend = (end - start) + 1;
+
+		strappend (cdata, "Content-Range: bytes ");
+		uintappend(cdata, start);
+		strappend (cdata, "-");
+		uintappend(cdata, end);
+		strappend (cdata, "/");
+		uintappend(cdata, fileinfo.st_size);
+		strappend (cdata, "\r\nContent-Length: ");
+		uintappend(cdata, cdata->tosend);
+		strappend (cdata, "\r\n");
+	} else {
+		memcpy(cdata->response + base, file->header, file->headerlen);
+		cdata->responselen = base + file->headerlen;
+	}
+
+	/*HEAD verb requires the same behaviour as GET without actually
+	  sending anything but the header, and empty files have nothing to send*/
+	if (req.head || notmodified || !fileinfo.st_size) {
+		fcache_release(file);
+		cdata->readfile = false;
+	} else {
+		/*The cached fd is shared, sendfile keeps the offset in cdata*/
+		cdata->file     = file;
+		cdata->rfd      = file->fd;
+		cdata->readfile = true;
+		/*Small files are sent from memory, in the same write as the header*/
+		if (file->body)
+			cdata->body = file->body + cdata->offset;
+	}
+
+	goto conn_type;
+
+	/*Pretty much does the closing argument*/
+	conn_status:
+		/*Might be useful for debugging*/
+		strappend(cdata, "Server: httpc\r\n");
+
+	conn_type:
+		/*Counted by the first digit of the status code*/
+		metrics_status(cdata->response[base + 9]);
+
+		/*Required on every response, formatted once a second by date_tick*/
+		bufappend(cdata, date_line, sizeof(date_line));
+
+		/*Post connection status*/
+		if (cdata->keepalive)
+			strappend(cdata, "Connection: Keep-Alive\r\n\r\n");
+		else
+			strappend(cdata, "Connection: close\r\n\r\n");
+
+	return true;
+}
+
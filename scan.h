@@ -0,0 +1,169 @@
+/*Byte scanning kernels for the request parser. They skip over the bytes that
+  can't end the token being parsed, many at a time, and leave the byte they
+  stop on to the parser's state machine.*/
+/*Both kernels return the offset of the first matching byte, or len if there is none:
+  scan_eol stops at '\r' and '\n', which is what ends a header value.
+  scan_ctl stops at control characters, white space, and extra,
+  which is what ends the method, target, version, and header names.*/
+/*SSE2 is part of x86-64 itself, the AVX2 versions are picked at startup by
+  scan_init if cpuid reports them. Everywhere else the scalar versions are used.*/
+
+size_t scan_eol_scalar(const char *buf, size_t len)
+{
+	size_t i;
+
+	for (i = 0; (i < len) && (buf[i] != '\r') && (buf[i] != '\n'); i++);
+
+	return i;
+}
+
+size_t scan_ctl_scalar(const char *buf, size_t len, char extra)
+{
+	size_t i;
+
+	for (i = 0; (i < len) && ((unsigned char)buf[i] > ' ') && (buf[i] != extra); i++);
+
+	return i;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+__attribute__((target("sse2")))
+size_t scan_eol_sse2(const char *buf, size_t len)
+{
+	size_t i;
+	unsigned int mask;
+	__m128i v, cr, lf;
+
+	cr = _mm_set1_epi8('\r');
+	lf = _mm_set1_epi8('\n');
+
+	for (i = 0; (i + 16) <= len; i += 16) {
+		v    = _mm_loadu_si128((const __m128i *)(buf + i));
+		mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, cr), _mm_cmpeq_epi8(v, lf)));
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+
+	return i + scan_eol_scalar(buf + i, len - i);
+}
+
+__attribute__((target("sse2")))
+size_t scan_ctl_sse2(const char *buf, size_t len, char extra)
+{
+	size_t i;
+	unsigned int mask;
+	__m128i v, sp, ex;
+
+	sp = _mm_set1_epi8(' ');
+	ex = _mm_set1_epi8(extra);
+
+	for (i = 0; (i + 16) <= len; i += 16) {
+		v    = _mm_loadu_si128((const __m128i *)(buf + i));
+		/*There is no unsigned compare, but min(v, ' ') == v means v <= ' '*/
+		mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(_mm_min_epu8(v, sp), v),
+						      _mm_cmpeq_epi8(v, ex)));
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+
+	return i + scan_ctl_scalar(buf + i, len - i, extra);
+}
+
+__attribute__((target("avx2")))
+size_t scan_eol_avx2(const char *buf, size_t len)
+{
+	size_t i;
+	unsigned int mask;
+	__m128i v128;
+	__m256i v, cr, lf;
+
+	cr = _mm256_set1_epi8('\r');
+	lf = _mm256_set1_epi8('\n');
+
+	for (i = 0; (i + 32) <= len; i += 32) {
+		v    = _mm256_loadu_si256((const __m256i *)(buf + i));
+		mask = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(v, cr),
+							    _mm256_cmpeq_epi8(v, lf)));
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+
+	/*The tail is done here rather than in the SSE2 version, mixing in
+	  legacy SSE instructions after AVX ones stalls some cpus*/
+	if ((i + 16) <= len) {
+		v128 = _mm_loadu_si128((const __m128i *)(buf + i));
+		mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v128, _mm_set1_epi8('\r')),
+						      _mm_cmpeq_epi8(v128, _mm_set1_epi8('\n'))));
+		if (mask)
+			return i + __builtin_ctz(mask);
+		i += 16;
+	}
+
+	return i + scan_eol_scalar(buf + i, len - i);
+}
+
+__attribute__((target("avx2")))
+size_t scan_ctl_avx2(const char *buf, size_t len, char extra)
+{
+	size_t i;
+	unsigned int mask;
+	__m128i v128;
+	__m256i v, sp, ex;
+
+	sp = _mm256_set1_epi8(' ');
+	ex = _mm256_set1_epi8(extra);
+
+	for (i = 0; (i + 32) <= len; i += 32) {
+		v    = _mm256_loadu_si256((const __m256i *)(buf + i));
+		mask = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(_mm256_min_epu8(v, sp), v),
+							    _mm256_cmpeq_epi8(v, ex)));
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+
+	if ((i + 16) <= len) {
+		v128 = _mm_loadu_si128((const __m128i *)(buf + i));
+		mask = _mm_movemask_epi8(_mm_or_si128(
+			_mm_cmpeq_epi8(_mm_min_epu8(v128, _mm_set1_epi8(' ')), v128),
+			_mm_cmpeq_epi8(v128, _mm_set1_epi8(extra))));
+		if (mask)
+			return i + __builtin_ctz(mask);
+		i += 16;
+	}
+
+	return i + scan_ctl_scalar(buf + i, len - i, extra);
+}
+#endif
+
+/*Kernels in use, set by scan_init*/
+size_t (*scan_eol)(const char *buf, size_t len)             = scan_eol_scalar;
+size_t (*scan_ctl)(const char *buf, size_t len, char extra) = scan_ctl_scalar;
+
+/*Picks the widest kernels the cpu supports. isa forces a set, for
+  benchmarking, and is one of "scalar", "sse2" or "avx2", or NULL for the best.
+  Returns the name of the set picked.*/
+const char *scan_init(const char *isa)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	/*Runs cpuid, and checks the OS saves the AVX registers*/
+	__builtin_cpu_init();
+
+	if ((!isa || !strcmp(isa, "avx2")) && __builtin_cpu_supports("avx2")) {
+		scan_eol = scan_eol_avx2;
+		scan_ctl = scan_ctl_avx2;
+		return "avx2";
+	}
+
+	if ((!isa || !strcmp(isa, "sse2")) && __builtin_cpu_supports("sse2")) {
+		scan_eol = scan_eol_sse2;
+		scan_ctl = scan_ctl_sse2;
+		return "sse2";
+	}
+#endif
+
+	scan_eol = scan_eol_scalar;
+	scan_ctl = scan_ctl_scalar;
+	return "scalar";
+}
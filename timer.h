@@ -0,0 +1,210 @@
+/*Connection timeouts, kept in a hierarchical timing wheel per worker.
+  Connections are linked into the slot of the tick their deadline falls on,
+  so arming, re-arming and cancelling are O(1) and expiring a tick only
+  touches the connections that are due. Deadlines too far away for the
+  first level's slots wait on a coarser level and move down as it comes up.*/
+/*A connection has one timeout at a time, for the state it is in:
+  - TIMER_HEADER while a request header is being received, counted from
+    accepting or from the first byte of the request, so a header sent one
+    byte at a time doesn't get more time for it
+  - TIMER_IDLE while a kept alive connection waits for its next request
+  - TIMER_SEND while a response is sent, counted from the last progress*/
+
+enum {
+	TIMER_NONE,
+	TIMER_HEADER,
+	TIMER_IDLE,
+	TIMER_SEND
+};
+
+/*Seconds for each timeout, set with -r, -k and -o, 0 turns one off*/
+unsigned int timer_limits[] = {0, 10, 60, 30};
+
+/*Length of a tick in milliseconds, timeouts are this precise*/
+#define TIMER_TICK_MS 100
+/*Every level has 64 slots, each slot of a level spans the 64 of the one below*/
+#define TIMER_BITS    6
+#define TIMER_SLOTS   (1 << TIMER_BITS)
+#define TIMER_MASK    (TIMER_SLOTS - 1)
+#define TIMER_LEVELS  4
+
+/*Tracking variables, one set per worker thread*/
+__thread client_data_t *timer_wheel[TIMER_LEVELS][TIMER_SLOTS];
+/*Next tick to expire, every tick before it has been*/
+__thread uint64_t timer_next;
+/*Current time in ticks and milliseconds, read once per event loop pass by timer_clock*/
+__thread uint64_t timer_tick;
+__thread uint64_t timer_ms;
+/*Connections with a timeout armed*/
+__thread size_t timer_count;
+/*Expired connections that haven't been handed out by timer_expire yet*/
+__thread client_data_t *timer_due;
+
+/*Reads the clock, the coarse one is plenty for 100ms ticks*/
+void timer_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	timer_ms   = (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+	timer_tick = timer_ms / TIMER_TICK_MS;
+}
+
+void timer_init(void)
+{
+	memset(timer_wheel, 0, sizeof(timer_wheel));
+	timer_clock();
+	timer_next  = timer_tick;
+	timer_count = 0;
+	timer_due   = NULL;
+}
+
+/*Links a connection into the slot for its deadline*/
+void timer_place(client_data_t *cdata)
+{
+	int level;
+	uint64_t delta;
+	client_data_t **slot;
+
+	/*Deadlines already passed go in the slot expired next*/
+	delta = (cdata->tdeadline > timer_next) ? (cdata->tdeadline - timer_next) : 0;
+	for (level = 0; (level < TIMER_LEVELS-1) &&
+	     (delta >= (1ull << (TIMER_BITS * (level+1)))); level++);
+	/*Further out than the wheel reaches, it waits on the last level again*/
+	if (delta >= (1ull << (TIMER_BITS * TIMER_LEVELS)))
+		cdata->tdeadline = timer_next + (1ull << (TIMER_BITS * TIMER_LEVELS)) - 1;
+
+	slot = &timer_wheel[level][(((delta ? cdata->tdeadline : timer_next))
+				    >> (TIMER_BITS * level)) & TIMER_MASK];
+	cdata->tnext = *slot;
+	cdata->tprev = slot;
+	if (*slot)
+		(*slot)->tprev = &cdata->tnext;
+	*slot = cdata;
+}
+
+void timer_unlink(client_data_t *cdata)
+{
+	*cdata->tprev = cdata->tnext;
+	if (cdata->tnext)
+		cdata->tnext->tprev = cdata->tprev;
+	cdata->tnext = NULL;
+	cdata->tprev = NULL;
+}
+
+/*Stops the connection's timeout*/
+void timer_cancel(client_data_t *cdata)
+{
+	if (cdata->tprev) {
+		timer_unlink(cdata);
+		timer_count--;
+	}
+	cdata->tkind = TIMER_NONE;
+}
+
+/*Starts the timeout of kind over, from now*/
+void timer_arm(client_data_t *cdata, unsigned char kind)
+{
+	uint64_t deadline;
+
+	if (!timer_limits[kind]) {
+		timer_cancel(cdata);
+		return;
+	}
+
+	deadline = timer_tick + (uint64_t)timer_limits[kind] * (1000 / TIMER_TICK_MS);
+	cdata->tkind = kind;
+	/*Re-arming within the same tick, as every send does, is free*/
+	if (cdata->tprev && (cdata->tdeadline == deadline))
+		return;
+
+	if (cdata->tprev)
+		timer_unlink(cdata);
+	else
+		timer_count++;
+
+	cdata->tdeadline = deadline;
+	timer_place(cdata);
+}
+
+/*Bytes of a request came in: a connection waiting for one starts the
+  header timeout, one already receiving a header keeps its deadline*/
+void timer_received(client_data_t *cdata)
+{
+	if (cdata->tkind != TIMER_HEADER)
+		timer_arm(cdata, TIMER_HEADER);
+}
+
+/*Moves the connections in a slot of a higher level down to where they belong now*/
+void timer_cascade(int level, unsigned int index)
+{
+	client_data_t *cdata, *next;
+
+	cdata = timer_wheel[level][index];
+	timer_wheel[level][index] = NULL;
+
+	for (; cdata; cdata = next) {
+		next = cdata->tnext;
+		timer_place(cdata);
+	}
+}
+
+/*Returns the next connection that has run out of time, NULL once there are none.
+  It is taken off the wheel, the caller closes it.*/
+client_data_t *timer_expire(void)
+{
+	int level;
+	unsigned int index;
+	client_data_t *cdata;
+
+	while (!timer_due && timer_count && (timer_next <= timer_tick)) {
+		/*When the first level comes around, the next slot of the one above moves down*/
+		for (level = 1; level < TIMER_LEVELS; level++) {
+			if ((timer_next >> (TIMER_BITS * (level-1))) & TIMER_MASK)
+				break;
+			timer_cascade(level, (timer_next >> (TIMER_BITS * level)) & TIMER_MASK);
+		}
+
+		index     = timer_next & TIMER_MASK;
+		timer_due = timer_wheel[0][index];
+		timer_wheel[0][index] = NULL;
+		if (timer_due)
+			timer_due->tprev = &timer_due;
+		timer_next++;
+	}
+
+	/*Nothing is waiting, so there are no slots to go through*/
+	if (!timer_count && (timer_next <= timer_tick))
+		timer_next = timer_tick + 1;
+
+	if (!(cdata = timer_due))
+		return NULL;
+
+	timer_unlink(cdata);
+	timer_count--;
+	return cdata;
+}
+
+/*Milliseconds until the next deadline, for epoll_wait, -1 if there is none.
+  Deadlines on the higher levels are looked at when they move down,
+  so until then this is when the first level comes around.*/
+int timer_timeout(void)
+{
+	uint64_t tick, at;
+
+	if (!timer_count)
+		return -1;
+	if (timer_due)
+		return 0;
+
+	for (tick = timer_next; tick < (timer_next + TIMER_SLOTS); tick++) {
+		if (timer_wheel[0][tick & TIMER_MASK])
+			break;
+		/*Slot 0 is where the levels above move down*/
+		if (!(tick & TIMER_MASK))
+			break;
+	}
+
+	at = tick * TIMER_TICK_MS;
+	return (at > timer_ms) ? (int)(at - timer_ms) : 0;
+}
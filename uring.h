@@ -0,0 +1,984 @@
+/*io_uring engine, an alternative to the epoll event loop selected with -e uring*/
+/*Instead of waiting for readiness and then making the syscalls, the operations
+  themselves are queued on a ring shared with the kernel:
+  - one multishot accept per worker, installing sockets straight into the
+    registered file table, so client sockets never get a regular fd
+  - one multishot recv per connection, filling buffers from a provided buffer ring
+  - response headers are sent linked to the splices that move the body from
+    the file into a pipe and from the pipe into the socket, or linked to a
+    send of the body when it is cached in memory
+  Requests are still parsed and answered with queue_responses and gen_response,
+  and cdata->cb_func still says whether the connection is receiving a request
+  (cb_recv), sending a header (cb_send), or sending a body (cb_sendfile).
+  Needs linux 6.0 for multishot recv, workers fall back to epoll without it.*/
+
+#if defined(__has_include) && __has_include(<linux/io_uring.h>)
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <linux/io_uring.h>
+
+/*Submission queue entries, the completion queue is four times larger
+  since multishot requests post many completions for one submission*/
+const unsigned int uring_entries  = 1024;
+/*Provided receive buffers per worker, must be a power of two*/
+const unsigned int uring_nbufs    = 512;
+const unsigned int uring_bufsize  = 4096;
+/*A connection stops receiving once this many buffers are waiting to be parsed*/
+const unsigned int uring_maxheld  = 8;
+/*Largest amount of body spliced through the pipe at a time, the default pipe size*/
+const size_t       uring_chunk    = 65536;
+
+/*Marks the end of a list of buffer ids*/
+#define URING_NOBUF 0xffff
+
+/*The operation is kept in the low bits of the user data, next to the cdata pointer*/
+enum {
+	URING_IGNORE,
+	URING_ACCEPT,
+	URING_WAKE,
+	URING_RECV,
+	URING_SEND,
+	URING_SPLICE_IN,
+	URING_SPLICE_OUT,
+	URING_SEND_BODY
+};
+#define URING_OPMASK 7ull
+
+/*Everything a worker needs to drive its ring*/
+typedef struct {
+	int fd;
+
+	/*Submission ring*/
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	struct io_uring_sqe *sqes;
+	unsigned sq_entries;
+	/*Local tail, published to the kernel on submit*/
+	unsigned sq_local;
+	unsigned pending;
+
+	/*Completion ring*/
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	/*Mapped memory*/
+	void *ring;
+	size_t ringsize;
+	size_t sqessize;
+
+	/*Provided buffer ring, buffer group 0*/
+	struct io_uring_buf_ring *br;
+	size_t brsize;
+	char *bufs;
+	unsigned short br_tail;
+	/*Length of the data in a buffer, and the next buffer in a held list*/
+	unsigned short *buflen;
+	unsigned short *bufnext;
+	unsigned int held_total;
+
+	/*Connections whose multishot recv ran out of buffers*/
+	client_data_t *starved;
+
+	int lsock;
+	int wakefd;
+	uint64_t wakeval;
+	/*The multishot accept is queued, and it was stopped because no more clients fit*/
+	bool accept_armed;
+	bool accept_paused;
+	/*Accepting stopped for good after the listening socket was handed over*/
+	bool drained;
+}uring_t;
+
+__thread uring_t uring;
+
+/*The syscalls have no glibc wrappers*/
+int uring_enter(unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+	return (int)syscall(__NR_io_uring_enter, uring.fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+/*Submits and waits for a completion, at most timeout milliseconds unless it is -1.
+  Fails with ETIME if the time runs out first.*/
+int uring_wait(unsigned to_submit, int timeout)
+{
+	struct __kernel_timespec ts;
+	struct io_uring_getevents_arg arg;
+
+	if (timeout < 0)
+		return uring_enter(to_submit, 1, IORING_ENTER_GETEVENTS);
+
+	memset(&arg, 0, sizeof(arg));
+	ts.tv_sec  = timeout / 1000;
+	ts.tv_nsec = (timeout % 1000) * 1000000ll;
+	arg.ts     = (uint64_t)(uintptr_t)&ts;
+
+	return (int)syscall(__NR_io_uring_enter, uring.fd, to_submit, 1,
+			    IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+}
+
+int uring_register(unsigned opcode, void *arg, unsigned nr_args)
+{
+	return (int)syscall(__NR_io_uring_register, uring.fd, opcode, arg, nr_args);
+}
+
+/*Hands the queued submissions to the kernel, without waiting for anything*/
+void uring_submit(void)
+{
+	int ret;
+
+	__atomic_store_n(uring.sq_tail, uring.sq_local, __ATOMIC_RELEASE);
+
+	while (uring.pending) {
+		ret = uring_enter(uring.pending, 0, 0);
+		if (ret < 0) {
+			if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+				continue;
+			die("io_uring_enter: %d\n", errno);
+		}
+		uring.pending -= ret;
+	}
+}
+
+/*Returns a cleared submission queue entry, submitting first if the queue is full*/
+struct io_uring_sqe *uring_sqe(unsigned char opcode, int fd, client_data_t *cdata, unsigned op)
+{
+	unsigned idx;
+	struct io_uring_sqe *sqe;
+
+	if ((uring.sq_local - __atomic_load_n(uring.sq_head, __ATOMIC_ACQUIRE)) >= uring.sq_entries)
+		uring_submit();
+
+	idx = uring.sq_local & *uring.sq_mask;
+	sqe = &uring.sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+
+	sqe->opcode    = opcode;
+	sqe->fd        = fd;
+	sqe->user_data = (uint64_t)(uintptr_t)cdata | op;
+
+	uring.sq_array[idx] = idx;
+	uring.sq_local++;
+	uring.pending++;
+
+	/*Operations on a connection keep its struct alive until they complete*/
+	if (cdata)
+		cdata->inflight++;
+
+	return sqe;
+}
+
+/*Gives a receive buffer back to the kernel*/
+void uring_recycle(unsigned short bid)
+{
+	struct io_uring_buf *buf;
+
+	buf       = &uring.br->bufs[uring.br_tail & (uring_nbufs-1)];
+	buf->addr = (uint64_t)(uintptr_t)(uring.bufs + ((size_t)bid * uring_bufsize));
+	buf->len  = uring_bufsize;
+	buf->bid  = bid;
+	uring.br_tail++;
+
+	__atomic_store_n(&uring.br->tail, uring.br_tail, __ATOMIC_RELEASE);
+}
+
+/*Sets up the rings, returns false if the kernel doesn't support what is needed*/
+bool uring_init(int lsock, int wakefd)
+{
+	int *files, one;
+	unsigned i, nfiles;
+	struct rlimit rlim;
+	struct io_uring_params params;
+	struct io_uring_buf_reg reg;
+
+	memset(&uring, 0, sizeof(uring));
+	uring.fd = -1;
+
+	/*Single issuer is 6.0, the same release as multishot recv, so it doubles
+	  as the version check. Deferred task running is 6.1 and only nice to have.*/
+	memset(&params, 0, sizeof(params));
+	params.flags      = IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER |
+			    IORING_SETUP_DEFER_TASKRUN;
+	params.cq_entries = uring_entries * 4;
+	uring.fd = (int)syscall(__NR_io_uring_setup, uring_entries, &params);
+	if (uring.fd < 0) {
+		memset(&params, 0, sizeof(params));
+		params.flags      = IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER |
+				    IORING_SETUP_COOP_TASKRUN;
+		params.cq_entries = uring_entries * 4;
+		uring.fd = (int)syscall(__NR_io_uring_setup, uring_entries, &params);
+	}
+	if (uring.fd < 0)
+		return false;
+
+	if (!(params.features & IORING_FEAT_SINGLE_MMAP) ||
+	    !(params.features & IORING_FEAT_NODROP))
+		goto fail;
+
+	/*Both rings live in one mapping*/
+	uring.ringsize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	if (uring.ringsize < params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe))
+		uring.ringsize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+
+	uring.ring = mmap(NULL, uring.ringsize, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_SQ_RING);
+	if (uring.ring == MAP_FAILED) {
+		uring.ring = NULL;
+		goto fail;
+	}
+
+	uring.sqessize = params.sq_entries * sizeof(struct io_uring_sqe);
+	uring.sqes     = mmap(NULL, uring.sqessize, PROT_READ | PROT_WRITE,
+			      MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_SQES);
+	if (uring.sqes == MAP_FAILED) {
+		uring.sqes = NULL;
+		goto fail;
+	}
+
+	uring.sq_head    = (unsigned *)((char *)uring.ring + params.sq_off.head);
+	uring.sq_tail    = (unsigned *)((char *)uring.ring + params.sq_off.tail);
+	uring.sq_mask    = (unsigned *)((char *)uring.ring + params.sq_off.ring_mask);
+	uring.sq_array   = (unsigned *)((char *)uring.ring + params.sq_off.array);
+	uring.sq_entries = params.sq_entries;
+	uring.sq_local   = *uring.sq_tail;
+	uring.cq_head    = (unsigned *)((char *)uring.ring + params.cq_off.head);
+	uring.cq_tail    = (unsigned *)((char *)uring.ring + params.cq_off.tail);
+	uring.cq_mask    = (unsigned *)((char *)uring.ring + params.cq_off.ring_mask);
+	uring.cqes       = (struct io_uring_cqe *)((char *)uring.ring + params.cq_off.cqes);
+
+	/*Sparse file table for the accepted sockets, which counts against the fd limit*/
+	nfiles = (gcdata_cap < 65536) ? gcdata_cap : 65536;
+	if (!getrlimit(RLIMIT_NOFILE, &rlim) && (rlim.rlim_cur < nfiles))
+		nfiles = rlim.rlim_cur;
+
+	files = palloc(sizeof(int), nfiles);
+	for (i = 0; i < nfiles; i++)
+		files[i] = -1;
+	i = uring_register(IORING_REGISTER_FILES, files, nfiles);
+	free(files);
+	if ((int)i < 0)
+		goto fail;
+
+	/*Provided buffer ring*/
+	uring.brsize = uring_nbufs * sizeof(struct io_uring_buf);
+	uring.br     = mmap(NULL, uring.brsize, PROT_READ | PROT_WRITE,
+			    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (uring.br == MAP_FAILED) {
+		uring.br = NULL;
+		goto fail;
+	}
+
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr    = (uint64_t)(uintptr_t)uring.br;
+	reg.ring_entries = uring_nbufs;
+	reg.bgid         = 0;
+	if (uring_register(IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+		goto fail;
+
+	uring.bufs    = palloc(uring_bufsize, uring_nbufs);
+	uring.buflen  = palloc(sizeof(unsigned short), uring_nbufs);
+	uring.bufnext = palloc(sizeof(unsigned short), uring_nbufs);
+	for (i = 0; i < uring_nbufs; i++)
+		uring_recycle(i);
+
+	/*Direct descriptors can't take setsockopt, but accepted sockets copy
+	  TCP_NODELAY from the listener, see cb_accept*/
+	one = 1;
+	setsockopt(lsock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	uring.lsock  = lsock;
+	uring.wakefd = wakefd;
+	return true;
+
+fail:
+	if (uring.br)
+		munmap(uring.br, uring.brsize);
+	if (uring.sqes)
+		munmap(uring.sqes, uring.sqessize);
+	if (uring.ring)
+		munmap(uring.ring, uring.ringsize);
+	close(uring.fd);
+	return false;
+}
+
+void uring_arm_accept(void)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = uring_sqe(IORING_OP_ACCEPT, uring.lsock, NULL, URING_ACCEPT);
+	sqe->ioprio     = IORING_ACCEPT_MULTISHOT;
+	sqe->file_index = IORING_FILE_INDEX_ALLOC;
+	uring.accept_armed = true;
+}
+
+/*Stops accepting until a connection is freed, so connections wait in the
+  backlog instead of being accepted only to be closed again*/
+void uring_pause_accept(void)
+{
+	struct io_uring_sqe *sqe;
+
+	if (uring.accept_paused)
+		return;
+	uring.accept_paused = true;
+	wmetrics->accept_pauses++;
+
+	sqe = uring_sqe(IORING_OP_ASYNC_CANCEL, -1, NULL, URING_IGNORE);
+	sqe->addr = URING_ACCEPT;
+}
+
+void uring_arm_wake(void)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = uring_sqe(IORING_OP_READ, uring.wakefd, NULL, URING_WAKE);
+	sqe->addr = (uint64_t)(uintptr_t)&uring.wakeval;
+	sqe->len  = sizeof(uring.wakeval);
+	sqe->off  = (uint64_t)-1;
+}
+
+void uring_arm_recv(client_data_t *cdata)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = uring_sqe(IORING_OP_RECV, cdata->fd, cdata, URING_RECV);
+	sqe->flags     = IOSQE_FIXED_FILE | IOSQE_BUFFER_SELECT;
+	sqe->ioprio    = IORING_RECV_MULTISHOT;
+	sqe->buf_group = 0;
+
+	cdata->recv_armed = true;
+}
+
+/*Stops the multishot recv, its last completion comes with -ECANCELED*/
+void uring_cancel_recv(client_data_t *cdata)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = uring_sqe(IORING_OP_ASYNC_CANCEL, -1, NULL, URING_IGNORE);
+	sqe->addr = (uint64_t)(uintptr_t)cdata | URING_RECV;
+}
+
+/*Frees the held buffers of a connection*/
+void uring_drop_held(client_data_t *cdata)
+{
+	unsigned short bid;
+
+	while ((bid = cdata->held_head) != URING_NOBUF) {
+		cdata->held_head = uring.bufnext[bid];
+		uring_recycle(bid);
+		uring.held_total--;
+	}
+
+	cdata->held_tail = URING_NOBUF;
+	cdata->held_off  = 0;
+	cdata->held      = 0;
+}
+
+/*Closes the connection, the struct is freed once nothing is in flight anymore*/
+void uring_close(client_data_t *cdata)
+{
+	struct io_uring_sqe *sqe;
+
+	if (cdata->closing)
+		return;
+	cdata->closing = true;
+
+	if (cdata->recv_armed)
+		uring_cancel_recv(cdata);
+
+	/*Sends hold on to the socket until they complete, which a client that
+	  stopped reading never lets them do, so they are cancelled first.
+	  The link holds even if there was nothing to cancel.*/
+	if (cdata->cb_func != cb_recv) {
+		sqe = uring_sqe(IORING_OP_ASYNC_CANCEL, cdata->fd, NULL, URING_IGNORE);
+		sqe->flags        = IOSQE_IO_HARDLINK;
+		sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_FD_FIXED |
+				    IORING_ASYNC_CANCEL_ALL;
+	}
+
+	/*file_index is one based for close*/
+	sqe = uring_sqe(IORING_OP_CLOSE, 0, NULL, URING_IGNORE);
+	sqe->file_index = cdata->fd + 1;
+
+	timer_cancel(cdata);
+
+	uring_drop_held(cdata);
+
+	if (cdata->file) {
+		fcache_release(cdata->file);
+		cdata->file = NULL;
+	}
+	cdata->rfd = -1;
+}
+
+/*Frees a closed connection once its last operation has completed*/
+void uring_reap(client_data_t *cdata)
+{
+	if (!cdata->closing || cdata->inflight)
+		return;
+
+	if (cdata->pipefd[0] >= 0) {
+		close(cdata->pipefd[0]);
+		close(cdata->pipefd[1]);
+		cdata->pipefd[0] = cdata->pipefd[1] = -1;
+	}
+
+	/*Sends are done with the response buffer by now*/
+	free_buffers(cdata);
+	free_cdata(cdata);
+
+	/*There is room for another client now, if the accept hasn't
+	  finished being cancelled its last completion arms it again*/
+	if (uring.accept_paused) {
+		uring.accept_paused = false;
+		if (!uring.accept_armed && !end_program && !draining)
+			uring_arm_accept();
+	}
+}
+
+void uring_send_body(client_data_t *cdata);
+void uring_response_done(client_data_t *cdata);
+
+/*Same as worker_drain for the epoll engine, the accept is cancelled and
+  never armed again, and connections between requests are closed*/
+void uring_drain(void)
+{
+	size_t i;
+	client_data_t *cdata;
+	struct io_uring_sqe *sqe;
+
+	uring.drained = true;
+	if (uring.accept_armed && !uring.accept_paused) {
+		sqe = uring_sqe(IORING_OP_ASYNC_CANCEL, -1, NULL, URING_IGNORE);
+		sqe->addr = URING_ACCEPT;
+	}
+
+	for (i = 0; i < gcdata_len; i++) {
+		cdata = &gcdata[i / cdata_chunk][i % cdata_chunk];
+		if (!cdata->inuse || cdata->closing || (cdata->cb_func != cb_recv) ||
+		    cdata->request_recvd || cdata->held)
+			continue;
+
+		uring_close(cdata);
+		uring_reap(cdata);
+	}
+}
+
+/*Sends what is left of the response header, linked to the body if there is one*/
+void uring_send(client_data_t *cdata)
+{
+	bool body;
+	struct io_uring_sqe *sqe;
+
+	body = cdata->readfile && (cdata->tosend || cdata->pipelen);
+
+	if (cdata->response_sent < cdata->responselen) {
+		sqe = uring_sqe(IORING_OP_SEND, cdata->fd, cdata, URING_SEND);
+		sqe->flags     = IOSQE_FIXED_FILE | (body ? IOSQE_IO_LINK : 0);
+		sqe->addr      = (uint64_t)(uintptr_t)(cdata->response + cdata->response_sent);
+		sqe->len       = cdata->responselen - cdata->response_sent;
+		/*MSG_MORE lets the header leave in the same segment as the start of the body*/
+		sqe->msg_flags = MSG_WAITALL | (body ? MSG_MORE : 0);
+	}
+
+	if (!body)
+		return;
+
+	if (cdata->body) {
+		sqe = uring_sqe(IORING_OP_SEND, cdata->fd, cdata, URING_SEND_BODY);
+		sqe->flags     = IOSQE_FIXED_FILE;
+		sqe->addr      = (uint64_t)(uintptr_t)cdata->body;
+		sqe->len       = cdata->tosend;
+		sqe->msg_flags = MSG_WAITALL;
+	} else
+		uring_send_body(cdata);
+}
+
+/*Moves the next chunk of the body from the file into the pipe and from the
+  pipe into the socket, or just empties the pipe if a splice came up short*/
+void uring_send_body(client_data_t *cdata)
+{
+	size_t len;
+	struct io_uring_sqe *sqe;
+
+	if (cdata->pipelen) {
+		sqe = uring_sqe(IORING_OP_SPLICE, cdata->fd, cdata, URING_SPLICE_OUT);
+		sqe->flags         = IOSQE_FIXED_FILE;
+		sqe->splice_fd_in  = cdata->pipefd[0];
+		sqe->splice_off_in = (uint64_t)-1;
+		sqe->off           = (uint64_t)-1;
+		sqe->len           = cdata->pipelen;
+		sqe->splice_flags  = SPLICE_F_MOVE | (cdata->tosend ? SPLICE_F_MORE : 0);
+		return;
+	}
+
+	if (!cdata->tosend) {
+		/*Hands the file back to the cache*/
+		fcache_release(cdata->file);
+		cdata->file = NULL;
+		cdata->rfd  = -1;
+
+		uring_response_done(cdata);
+		return;
+	}
+
+	/*The pipe is kept for the rest of the connection*/
+	if (cdata->pipefd[0] < 0 && pipe2(cdata->pipefd, O_CLOEXEC) < 0) {
+		cdata->pipefd[0] = cdata->pipefd[1] = -1;
+		uring_close(cdata);
+		return;
+	}
+
+	len = (cdata->tosend < uring_chunk) ? cdata->tosend : uring_chunk;
+	cdata->splicelen = len;
+
+	sqe = uring_sqe(IORING_OP_SPLICE, cdata->pipefd[1], cdata, URING_SPLICE_IN);
+	sqe->flags         = IOSQE_IO_LINK;
+	sqe->splice_fd_in  = cdata->rfd;
+	sqe->splice_off_in = cdata->offset;
+	sqe->off           = (uint64_t)-1;
+	sqe->len           = len;
+	sqe->splice_flags  = SPLICE_F_MOVE;
+
+	sqe = uring_sqe(IORING_OP_SPLICE, cdata->fd, cdata, URING_SPLICE_OUT);
+	sqe->flags         = IOSQE_FIXED_FILE;
+	sqe->splice_fd_in  = cdata->pipefd[0];
+	sqe->splice_off_in = (uint64_t)-1;
+	sqe->off           = (uint64_t)-1;
+	sqe->len           = len;
+	sqe->splice_flags  = SPLICE_F_MOVE | ((cdata->tosend > len) ? SPLICE_F_MORE : 0);
+}
+
+/*Copies held buffers into the request buffer, as far as they fit*/
+void uring_feed(client_data_t *cdata)
+{
+	size_t len, space;
+	unsigned short bid;
+
+	if (cdata->held_head != URING_NOBUF)
+		alloc_buffers(cdata);
+
+	while ((bid = cdata->held_head) != URING_NOBUF) {
+		space = (headerlen - cdata->request_recvd) - 1;
+		if (!space)
+			break;
+
+		len = uring.buflen[bid] - cdata->held_off;
+		len = (len < space) ? len : space;
+
+		memcpy(cdata->request + cdata->request_recvd,
+		       uring.bufs + ((size_t)bid * uring_bufsize) + cdata->held_off, len);
+		cdata->request_recvd += len;
+		cdata->held_off      += len;
+
+		if (cdata->held_off < uring.buflen[bid])
+			break;
+
+		/*Buffer is used up*/
+		cdata->held_head = uring.bufnext[bid];
+		if (cdata->held_head == URING_NOBUF)
+			cdata->held_tail = URING_NOBUF;
+		cdata->held_off = 0;
+		cdata->held--;
+		uring.held_total--;
+		uring_recycle(bid);
+	}
+}
+
+/*Answers buffered requests if the connection is waiting for one*/
+void uring_recv_data(client_data_t *cdata)
+{
+	/*Data that comes in while a response is sent waits in the held buffers*/
+	if (cdata->closing || (cdata->cb_func != cb_recv))
+		return;
+
+	uring_feed(cdata);
+	if (cdata->request_recvd)
+		timer_received(cdata);
+
+	if (parse_request(cdata) != PARSE_INCOMPLETE) {
+		if (!queue_responses(cdata)) {
+			uring_close(cdata);
+			return;
+		}
+
+		uring_send(cdata);
+		return;
+	}
+
+	/*A full buffer without the end of the header can never become a request*/
+	if ((cdata->request_recvd >= (headerlen-1)) || cdata->eof) {
+		uring_close(cdata);
+		return;
+	}
+
+	/*Idle connections don't hold on to buffers*/
+	if (!cdata->request_recvd)
+		free_buffers(cdata);
+
+	if (!cdata->recv_armed && !cdata->starved && (cdata->held < uring_maxheld))
+		uring_arm_recv(cdata);
+}
+
+/*Same as response_done for the epoll engine*/
+void uring_response_done(client_data_t *cdata)
+{
+	metrics_answered(cdata);
+
+	if (!cdata->keepalive || draining) {
+		uring_close(cdata);
+		return;
+	}
+
+	/*Held buffers are fed in by uring_recv_data, which switches to the header timeout*/
+	timer_arm(cdata, TIMER_IDLE);
+
+	cdata->cb_func = cb_recv;
+	uring_recv_data(cdata);
+}
+
+void uring_accepted(int idx)
+{
+	client_data_t *cdata;
+	struct io_uring_sqe *sqe;
+
+	cdata = alloc_cdata();
+	if (!cdata) {
+		sqe = uring_sqe(IORING_OP_CLOSE, 0, NULL, URING_IGNORE);
+		sqe->file_index = idx + 1;
+		uring_pause_accept();
+		return;
+	}
+
+	/*Multishot accepts hand over connections before there is a chance to
+	  check, so accepting stops as the last slot is taken, not after*/
+	if (!cdata_available())
+		uring_pause_accept();
+
+	wmetrics->accepts++;
+
+	cdata->fd            = idx;
+	cdata->request_recvd = 0;
+	cdata->rfd           = -1;
+	cdata->file          = NULL;
+	cdata->keepalive     = true; /*Default according to the http/1.1 spec*/
+	cdata->cb_func       = cb_recv;
+	cdata->inflight      = 0;
+	cdata->pipefd[0]     = -1;
+	cdata->pipefd[1]     = -1;
+	cdata->pipelen       = 0;
+	cdata->held_head     = URING_NOBUF;
+	cdata->held_tail     = URING_NOBUF;
+	cdata->held_off      = 0;
+	cdata->held          = 0;
+	cdata->recv_armed    = false;
+	cdata->starved       = false;
+	cdata->eof           = false;
+	cdata->closing       = false;
+	parse_reset(cdata);
+
+	timer_arm(cdata, TIMER_HEADER);
+	uring_arm_recv(cdata);
+}
+
+void uring_received(client_data_t *cdata, struct io_uring_cqe *cqe)
+{
+	unsigned short bid;
+
+	if (!(cqe->flags & IORING_CQE_F_MORE))
+		cdata->recv_armed = false;
+
+	if (cqe->flags & IORING_CQE_F_BUFFER) {
+		bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+
+		if (cdata->closing || (cqe->res <= 0)) {
+			uring_recycle(bid);
+		} else {
+			/*Appended to the held list, uring_feed moves it into the request buffer*/
+			uring.buflen[bid]  = cqe->res;
+			uring.bufnext[bid] = URING_NOBUF;
+			if (cdata->held_tail != URING_NOBUF)
+				uring.bufnext[cdata->held_tail] = bid;
+			else
+				cdata->held_head = bid;
+			cdata->held_tail = bid;
+			cdata->held++;
+			uring.held_total++;
+
+			/*Pushes back on clients that pipeline far ahead of the responses*/
+			if ((cdata->held == uring_maxheld) && cdata->recv_armed)
+				uring_cancel_recv(cdata);
+		}
+	}
+
+	if (cdata->closing)
+		return;
+
+	if (!cqe->res)
+		cdata->eof = true;
+	else if (cqe->res == -ENOBUFS) {
+		/*Rearmed once buffers are given back*/
+		if (!cdata->starved) {
+			cdata->starved   = true;
+			/*next_free isn't used while the struct is in use*/
+			cdata->next_free = uring.starved;
+			uring.starved    = cdata;
+			cdata->inflight++;
+		}
+	} else if ((cqe->res < 0) && (cqe->res != -ECANCELED)) {
+		uring_close(cdata);
+		return;
+	}
+
+	uring_recv_data(cdata);
+}
+
+void uring_complete(struct io_uring_cqe *cqe)
+{
+	unsigned op;
+	client_data_t *cdata;
+
+	op    = cqe->user_data & URING_OPMASK;
+	cdata = (client_data_t *)(uintptr_t)(cqe->user_data & ~URING_OPMASK);
+
+	/*Multishot requests only count as in flight until their last completion*/
+	if (cdata && !((op == URING_RECV) && (cqe->flags & IORING_CQE_F_MORE)))
+		cdata->inflight--;
+
+	switch (op) {
+	case URING_ACCEPT:
+		if (cqe->res >= 0)
+			uring_accepted(cqe->res);
+		/*The file table is full*/
+		else if ((cqe->res == -ENFILE) || (cqe->res == -EMFILE))
+			uring_pause_accept();
+		else if ((cqe->res != -EAGAIN) && (cqe->res != -ECANCELED))
+			fprintf(stderr, "accept: %d\n", -cqe->res);
+
+		if (!(cqe->flags & IORING_CQE_F_MORE)) {
+			uring.accept_armed = false;
+			if (!end_program && !uring.accept_paused && !draining)
+				uring_arm_accept();
+		}
+		break;
+	case URING_RECV:
+		uring_received(cdata, cqe);
+		break;
+	case URING_SEND:
+		if (cdata->closing || (cqe->res == -ECANCELED))
+			break;
+		if (cqe->res <= 0) {
+			fprintf(stderr, "cb_send\n");
+			uring_close(cdata);
+			break;
+		}
+
+		cdata->response_sent   += cqe->res;
+		wmetrics->bytes_header += cqe->res;
+		timer_arm(cdata, TIMER_SEND);
+		/*A short send breaks the link to the body, so both get sent again*/
+		if (cdata->response_sent < cdata->responselen)
+			uring_send(cdata);
+		else if (!cdata->readfile)
+			uring_response_done(cdata);
+		else
+			cdata->cb_func = cb_sendfile;
+		break;
+	case URING_SEND_BODY:
+		if (cdata->closing || (cqe->res == -ECANCELED))
+			break;
+		if (cqe->res <= 0) {
+			fprintf(stderr, "cb_send\n");
+			uring_close(cdata);
+			break;
+		}
+
+		cdata->body   += cqe->res;
+		cdata->tosend -= cqe->res;
+		wmetrics->bytes_memory += cqe->res;
+		timer_arm(cdata, TIMER_SEND);
+		if (cdata->tosend) {
+			uring_send(cdata);
+			break;
+		}
+
+		fcache_release(cdata->file);
+		cdata->file     = NULL;
+		cdata->rfd      = -1;
+		cdata->body     = NULL;
+		cdata->readfile = false;
+
+		uring_response_done(cdata);
+		break;
+	case URING_SPLICE_IN:
+		if (cdata->closing || (cqe->res == -ECANCELED))
+			break;
+		if (cqe->res <= 0) {
+			fprintf(stderr, "cb_sendfile\n");
+			uring_close(cdata);
+			break;
+		}
+
+		cdata->offset  += cqe->res;
+		cdata->tosend  -= cqe->res;
+		cdata->pipelen += cqe->res;
+		/*The linked splice into the socket was cancelled, so the pipe gets emptied here*/
+		if ((size_t)cqe->res < cdata->splicelen)
+			uring_send_body(cdata);
+		break;
+	case URING_SPLICE_OUT:
+		if (cdata->closing || (cqe->res == -ECANCELED))
+			break;
+		if (cqe->res <= 0) {
+			fprintf(stderr, "cb_sendfile\n");
+			uring_close(cdata);
+			break;
+		}
+
+		cdata->pipelen -= cqe->res;
+		wmetrics->bytes_sendfile += cqe->res;
+		timer_arm(cdata, TIMER_SEND);
+		uring_send_body(cdata);
+		break;
+	case URING_WAKE:
+		/*Read again, so a signal during the drain can still stop the worker*/
+		if (draining && !end_program) {
+			uring_drain();
+			uring_arm_wake();
+		}
+		break;
+	case URING_IGNORE:
+	default:
+		break;
+	}
+
+	if (cdata)
+		uring_reap(cdata);
+}
+
+/*Rearms the recvs that ran out of buffers, once there are buffers again*/
+void uring_unstarve(void)
+{
+	client_data_t *cdata;
+
+	while (uring.starved && (uring.held_total < uring_nbufs)) {
+		cdata          = uring.starved;
+		uring.starved  = cdata->next_free;
+		cdata->next_free = NULL;
+		cdata->starved = false;
+		cdata->inflight--;
+
+		if (cdata->closing)
+			uring_reap(cdata);
+		else if (!cdata->recv_armed && (cdata->held < uring_maxheld) &&
+			 (cdata->cb_func == cb_recv))
+			uring_arm_recv(cdata);
+	}
+}
+
+/*Runs the worker on io_uring until shutdown.
+  Returns false without serving anything if io_uring can't be used.*/
+bool uring_run(int lsock, int wakefd)
+{
+	int ret;
+	size_t i;
+	unsigned head, tail;
+	client_data_t *cdata;
+	struct io_uring_sync_cancel_reg cancel;
+
+	if (!uring_init(lsock, wakefd))
+		return false;
+
+	/*Clients only have direct descriptors, which getpeername can't take*/
+	metrics_peers = false;
+	/*Connections are only switched to HTTP/2 by the epoll event loop*/
+	h2_enabled    = false;
+
+	uring_arm_accept();
+	uring_arm_wake();
+
+	while (!end_program) {
+		__atomic_store_n(uring.sq_tail, uring.sq_local, __ATOMIC_RELEASE);
+
+		/*Submits everything queued and sleeps until something completes,
+		  or until the next connection runs out of time*/
+		ret = uring_wait(uring.pending, timer_timeout());
+		if (ret < 0) {
+			if (errno == ETIME)
+				ret = 0;
+			else if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+				continue;
+			else
+				die("io_uring_enter: %d\n", errno);
+		}
+		uring.pending -= ret;
+
+		/*Read the clock once for everything this pass does*/
+		date_tick();
+		timer_clock();
+
+		head = *uring.cq_head;
+		tail = __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE);
+		wmetrics->wakeups++;
+		wmetrics->events += tail - head;
+		for (; head != tail; head++) {
+			uring_complete(&uring.cqes[head & *uring.cq_mask]);
+			/*Frees the slot early, completions can queue up more submissions*/
+			__atomic_store_n(uring.cq_head, head+1, __ATOMIC_RELEASE);
+		}
+
+		uring_unstarve();
+
+		while ((cdata = timer_expire())) {
+			wmetrics->timeouts++;
+			uring_close(cdata);
+			uring_reap(cdata);
+		}
+
+		if (uring.drained && !gcdata_inuse)
+			break;
+	}
+
+	/*Waits for every operation in flight to be cancelled, so the kernel is
+	  done with the buffers before they are freed. Closing the ring closes
+	  the sockets in the file table.*/
+	memset(&cancel, 0, sizeof(cancel));
+	cancel.fd              = -1;
+	cancel.flags           = IORING_ASYNC_CANCEL_ANY;
+	cancel.timeout.tv_sec  = -1;
+	cancel.timeout.tv_nsec = -1;
+	uring_register(IORING_REGISTER_SYNC_CANCEL, &cancel, 1);
+
+	close(uring.fd);
+	munmap(uring.br, uring.brsize);
+	munmap(uring.sqes, uring.sqessize);
+	munmap(uring.ring, uring.ringsize);
+
+	for (i = 0; i < gcdata_len; i++) {
+		cdata = &gcdata[i / cdata_chunk][i % cdata_chunk];
+		if (!cdata->inuse)
+			continue;
+
+		if (cdata->file)
+			fcache_release(cdata->file);
+		if (cdata->pipefd[0] >= 0) {
+			close(cdata->pipefd[0]);
+			close(cdata->pipefd[1]);
+		}
+		free_cdata(cdata);
+	}
+
+	free(uring.bufs);
+	free(uring.buflen);
+	free(uring.bufnext);
+	return true;
+}
+
+#else
+
+/*Built without io_uring headers, every worker uses epoll*/
+bool uring_run(int lsock, int wakefd)
+{
+	return false;
+}
+
+#endif